@@ -0,0 +1,125 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "band.h"
+#include "probes.h"
+#include "render.h"
+
+// pixman sizes images with ints, and positions pixels in 16.16 fixed point
+#define MAX_IMAGE_SIZE 32767
+// Bands are rendered in tiles of at most that many pixels a side, so that
+// outputs partially inside a tile stay within pixman's range
+#define TILE_SIZE 8192
+// Memory used by a band, when there is no budget
+#define DEFAULT_BAND_BYTES (64 << 20)
+
+static bool needs_bands(int32_t width, int32_t height, size_t budget) {
+	uint64_t size = (uint64_t)width * height * 4;
+	return width > MAX_IMAGE_SIZE || height > MAX_IMAGE_SIZE ||
+		size > INT_MAX || (budget > 0 && size > budget);
+}
+
+bool grim_render_needs_bands(const struct grim_box *geometry, double scale,
+		size_t budget) {
+	int32_t width, height;
+	if (!get_render_size(geometry, scale, &width, &height)) {
+		return false;
+	}
+	return needs_bands(width, height, budget);
+}
+
+bool init_band_source(struct grim_band_source *source,
+		struct grim_state *state, const struct grim_box *geometry, double scale,
+		size_t budget) {
+	*source = (struct grim_band_source){
+		.state = state,
+		.geometry = *geometry,
+		.scale = scale,
+	};
+	if (!get_render_size(geometry, scale, &source->width, &source->height)) {
+		return false;
+	}
+
+	size_t stride = (size_t)source->width * 4;
+	if (stride > INT_MAX) {
+		fprintf(stderr, "image is too wide\n");
+		return false;
+	}
+	size_t band_bytes = budget > 0 ? budget : DEFAULT_BAND_BYTES;
+	size_t band_height = band_bytes / stride;
+	if (band_height > INT_MAX / stride) {
+		band_height = INT_MAX / stride;
+	}
+	if (band_height > TILE_SIZE) {
+		band_height = TILE_SIZE;
+	}
+	if (band_height > (size_t)source->height) {
+		band_height = source->height;
+	}
+	if (band_height == 0) {
+		// A single row over budget, still better than failing
+		band_height = 1;
+	}
+	source->band_height = band_height;
+	return true;
+}
+
+static bool render_band(const struct grim_band_source *source,
+		uint32_t *data, int stride, int32_t y, int32_t height) {
+	for (int32_t x = 0; x < source->width; x += TILE_SIZE) {
+		int32_t width = source->width - x;
+		if (width > TILE_SIZE) {
+			width = TILE_SIZE;
+		}
+		pixman_image_t *tile = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+			width, height, data + x, stride);
+		if (tile == NULL) {
+			fprintf(stderr, "failed to create tile image\n");
+			return false;
+		}
+		bool ok = render_tile(source->state, &source->geometry,
+			source->scale, tile, x, y);
+		pixman_image_unref(tile);
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int grim_for_each_band_row(const struct grim_band_source *source,
+		band_row_func func, void *data) {
+	int stride = source->width * 4;
+	size_t band_size = (size_t)stride * source->band_height;
+	uint32_t *band = malloc(band_size);
+	if (band == NULL) {
+		fprintf(stderr, "failed to allocate band\n");
+		return -1;
+	}
+
+	int ret = 0;
+	for (int32_t y = 0; y < source->height && ret == 0;
+			y += source->band_height) {
+		int32_t height = source->height - y;
+		if (height > source->band_height) {
+			height = source->band_height;
+		}
+
+		GRIM_PROBE(render_band, y, height, source->height);
+		// Outputs are blended onto transparent pixels
+		memset(band, 0, (size_t)stride * height);
+		if (!render_band(source, band, stride, y, height)) {
+			ret = -1;
+			break;
+		}
+
+		for (int32_t i = 0; i < height && ret == 0; i++) {
+			ret = func(data, band + (size_t)i * source->width, y + i);
+		}
+	}
+
+	free(band);
+	return ret;
+}
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "bench.h"
+
+enum bench_phase {
+	BENCH_CAPTURE,
+	BENCH_RENDER,
+	BENCH_ENCODE,
+	BENCH_TOTAL,
+};
+
+#define BENCH_PHASES (BENCH_TOTAL + 1)
+
+static const char *const phase_names[] = {
+	[BENCH_CAPTURE] = "capture",
+	[BENCH_RENDER] = "render",
+	[BENCH_ENCODE] = "encode",
+	[BENCH_TOTAL] = "total",
+};
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Images go nowhere, only their size is kept
+static int count_write(void *data, const void *buf, size_t len) {
+	size_t *size = data;
+	*size += len;
+	return 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+	double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+// Nearest-rank percentile of sorted samples
+static double percentile(const double *samples, uint32_t n, double p) {
+	uint32_t rank = ceil(p / 100 * n);
+	return samples[rank > 0 ? rank - 1 : 0];
+}
+
+// Heap in use, counting large blocks mmap'ed by malloc
+static size_t heap_in_use(void) {
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+	struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+bool run_bench(struct grim_state *state, const struct bench_options *options) {
+	uint32_t n = options->n_runs;
+	bool ok = false;
+	double *samples[BENCH_PHASES] = {0};
+	for (size_t i = 0; i < BENCH_PHASES; i++) {
+		samples[i] = calloc(n, sizeof(double));
+		if (samples[i] == NULL) {
+			fprintf(stderr, "failed to allocate samples\n");
+			goto out;
+		}
+	}
+
+	size_t buffers_before = grim_get_buffers_created(state);
+	size_t heap_before = heap_in_use(), heap_peak = heap_before;
+	size_t encoded_size = 0;
+	int32_t width = 0, height = 0;
+	ok = true;
+	double start = now_ms();
+	for (uint32_t i = 0; ok && i < n; i++) {
+		double t0 = now_ms();
+		ok = grim_capture(state, options->geometry, options->with_cursor);
+		if (!ok) {
+			break;
+		}
+		double t1 = now_ms();
+		pixman_image_t *image = grim_render(state, options->geometry,
+			options->scale);
+		if (image == NULL) {
+			ok = false;
+			break;
+		}
+		double t2 = now_ms();
+		// The image is still around: this is the high-water mark of a run
+		size_t heap = heap_in_use();
+		if (heap > heap_peak) {
+			heap_peak = heap;
+		}
+		ok = grim_encode(image, options->encode_options, count_write,
+			&encoded_size) == 0;
+		double t3 = now_ms();
+		width = pixman_image_get_width(image);
+		height = pixman_image_get_height(image);
+		pixman_image_unref(image);
+
+		samples[BENCH_CAPTURE][i] = t1 - t0;
+		samples[BENCH_RENDER][i] = t2 - t1;
+		samples[BENCH_ENCODE][i] = t3 - t2;
+		samples[BENCH_TOTAL][i] = t3 - t0;
+	}
+	double elapsed = now_ms() - start;
+	if (!ok) {
+		fprintf(stderr, "benchmark run failed\n");
+		goto out;
+	}
+
+	printf("%" PRIu32 " runs of %" PRIi32 "x%" PRIi32 ", %.1f KiB encoded "
+		"on average\n", n, width, height, encoded_size / 1024.0 / n);
+	printf("%-8s %9s %9s %9s\n", "ms", "p50", "p95", "p99");
+	for (size_t i = 0; i < BENCH_PHASES; i++) {
+		qsort(samples[i], n, sizeof(double), compare_double);
+		printf("%-8s %9.2f %9.2f %9.2f\n", phase_names[i],
+			percentile(samples[i], n, 50), percentile(samples[i], n, 95),
+			percentile(samples[i], n, 99));
+	}
+	printf("%.2f frames per second\n", n * 1000 / elapsed);
+	printf("%zu buffers created\n",
+		grim_get_buffers_created(state) - buffers_before);
+	if (heap_before > 0) {
+		size_t heap_after = heap_in_use();
+		printf("heap: %+.1f KiB after the runs, %.1f KiB more at peak\n",
+			((double)heap_after - heap_before) / 1024,
+			(heap_peak - heap_before) / 1024.0);
+	}
+
+out:
+	for (size_t i = 0; i < BENCH_PHASES; i++) {
+		free(samples[i]);
+	}
+	return ok;
+}
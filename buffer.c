@@ -1,6 +1,7 @@
 #define _POSIX_C_SOURCE 200112L
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,6 +10,9 @@
 #include <unistd.h>
 
 #include "buffer.h"
+#include "grim.h"
+#include "probes.h"
+#include "render.h"
 
 static void randname(char *buf) {
 	struct timespec ts;
@@ -53,30 +57,100 @@ static int create_shm_file(off_t size) {
 	return fd;
 }
 
-struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
-		int32_t width, int32_t height, int32_t stride) {
-	size_t size = stride * height;
+static bool check_buffer_size(enum wl_shm_format format, int32_t width,
+		int32_t height, int32_t stride, off_t offset) {
+	// Formats pixman can't read are refused when rendering
+	int bpp = PIXMAN_FORMAT_BPP(get_pixman_format(format));
+	if (width <= 0 || height <= 0 || stride <= 0 ||
+			(int64_t)stride * 8 < (int64_t)width * bpp) {
+		fprintf(stderr, "invalid buffer size %dx%d, stride %d\n",
+			width, height, stride);
+		return false;
+	}
+	size_t size = (size_t)stride * height;
+	// wl_shm pools are sized with an int32_t
+	if (size > INT32_MAX || (size_t)offset > INT32_MAX - size) {
+		fprintf(stderr, "buffer of %zu bytes is too large for wl_shm\n",
+			size);
+		return false;
+	}
+	return true;
+}
 
-	int fd = create_shm_file(size);
-	if (fd == -1) {
+struct grim_buffer *create_buffer_from_fd(struct wl_shm *shm, int fd,
+		off_t offset, enum wl_shm_format format, int32_t width, int32_t height,
+		int32_t stride) {
+	if (!check_buffer_size(format, width, height, stride, offset)) {
+		return NULL;
+	}
+	size_t size = (size_t)stride * height;
+	GRIM_PROBE(create_buffer, format, width, height, stride, size);
+
+	// mmap wants a page-aligned offset
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t map_offset = offset % page_size;
+	void *map = mmap(NULL, map_offset + size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, offset - map_offset);
+	if (map == MAP_FAILED) {
 		return NULL;
 	}
 
-	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	if (data == MAP_FAILED) {
-		close(fd);
+	struct grim_buffer *buffer = calloc(1, sizeof(struct grim_buffer));
+	if (buffer == NULL) {
+		munmap(map, map_offset + size);
 		return NULL;
 	}
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
+	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, offset + size);
 	struct wl_buffer *wl_buffer =
-		wl_shm_pool_create_buffer(pool, 0, width, height, stride, format);
+		wl_shm_pool_create_buffer(pool, offset, width, height, stride, format);
 	wl_shm_pool_destroy(pool);
 
+	buffer->wl_buffer = wl_buffer;
+	buffer->data = (char *)map + map_offset;
+	buffer->map_offset = map_offset;
+	buffer->width = width;
+	buffer->height = height;
+	buffer->stride = stride;
+	buffer->size = size;
+	buffer->format = format;
+	return buffer;
+}
+
+struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
+		int32_t width, int32_t height, int32_t stride) {
+	// Before the file is sized after it
+	if (!check_buffer_size(format, width, height, stride, 0)) {
+		return NULL;
+	}
+	size_t size = (size_t)stride * height;
+	int fd = create_shm_file(size);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct grim_buffer *buffer = create_buffer_from_fd(shm, fd, 0, format,
+		width, height, stride);
 	close(fd);
+	return buffer;
+}
+
+struct grim_buffer *load_buffer(int fd, enum wl_shm_format format,
+		int32_t width, int32_t height, int32_t stride) {
+	size_t size = (size_t)stride * height;
+
+	// Private, so that the file is left alone whatever is done with the
+	// pixels
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		return NULL;
+	}
 
 	struct grim_buffer *buffer = calloc(1, sizeof(struct grim_buffer));
-	buffer->wl_buffer = wl_buffer;
+	if (buffer == NULL) {
+		munmap(data, size);
+		return NULL;
+	}
 	buffer->data = data;
 	buffer->width = width;
 	buffer->height = height;
@@ -86,11 +160,48 @@ struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
 	return buffer;
 }
 
+static bool buffer_matches(struct grim_buffer *buffer, uint32_t format,
+		uint32_t width, uint32_t height, uint32_t stride) {
+	return buffer->format == format && buffer->width == (int32_t)width &&
+		buffer->height == (int32_t)height && buffer->stride == (int32_t)stride;
+}
+
+struct grim_buffer *get_frame_buffer(struct grim_state *state,
+		struct grim_output *output, struct grim_buffer **spare_ptr,
+		uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+	bool use_buffer_func = state->buffer_func != NULL && output != NULL;
+	struct grim_buffer *spare = *spare_ptr;
+	*spare_ptr = NULL;
+	if (spare != NULL && !use_buffer_func &&
+			buffer_matches(spare, format, width, height, stride)) {
+		return spare;
+	}
+	destroy_buffer(spare);
+	state->n_buffers_created++;
+
+	if (!use_buffer_func) {
+		return create_buffer(state->shm, format, width, height, stride);
+	}
+
+	size_t size = (size_t)stride * height;
+	off_t offset = 0;
+	int fd = state->buffer_func(state->buffer_func_data, output, size,
+		&offset);
+	if (fd < 0) {
+		return NULL;
+	}
+	return create_buffer_from_fd(state->shm, fd, offset, format, width,
+		height, stride);
+}
+
 void destroy_buffer(struct grim_buffer *buffer) {
 	if (buffer == NULL) {
 		return;
 	}
-	munmap(buffer->data, buffer->size);
-	wl_buffer_destroy(buffer->wl_buffer);
+	munmap((char *)buffer->data - buffer->map_offset,
+		buffer->map_offset + buffer->size);
+	if (buffer->wl_buffer != NULL) {
+		wl_buffer_destroy(buffer->wl_buffer);
+	}
 	free(buffer);
 }
@@ -0,0 +1,536 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "copy-capture.h"
+#include "grim.h"
+#include "output-layout.h"
+#include "probes.h"
+
+static void screencopy_frame_handle_buffer(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width,
+		uint32_t height, uint32_t stride) {
+	struct grim_output *output = data;
+
+	GRIM_PROBE(frame_buffer, output->name, format, width, height, stride);
+
+	output->buffer = get_frame_buffer(output->state, output,
+		&output->spare_buffer, format, width, height, stride);
+	if (output->buffer == NULL) {
+		fprintf(stderr, "failed to create buffer\n");
+		output->state->capture_failed = true;
+		return;
+	}
+
+	zwlr_screencopy_frame_v1_copy(frame, output->buffer->wl_buffer);
+}
+
+static void screencopy_frame_handle_flags(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
+	struct grim_output *output = data;
+	output->screencopy_frame_flags = flags;
+}
+
+static void screencopy_frame_handle_ready(void *data,
+		struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	struct grim_output *output = data;
+	GRIM_PROBE(frame_ready, output->name, output->buffer->width,
+		output->buffer->height, output->buffer->size);
+	++output->state->n_done;
+}
+
+static void screencopy_frame_handle_failed(void *data,
+		struct zwlr_screencopy_frame_v1 *frame) {
+	struct grim_output *output = data;
+	GRIM_PROBE(frame_failed, output->name);
+	fprintf(stderr, "failed to copy output %s\n", output->name);
+	output->state->capture_failed = true;
+}
+
+static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener = {
+	.buffer = screencopy_frame_handle_buffer,
+	.flags = screencopy_frame_handle_flags,
+	.ready = screencopy_frame_handle_ready,
+	.failed = screencopy_frame_handle_failed,
+};
+
+
+static void xdg_output_handle_logical_position(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {
+	struct grim_output *output = data;
+
+	output->logical_geometry.x = x;
+	output->logical_geometry.y = y;
+}
+
+static void xdg_output_handle_logical_size(void *data,
+		struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
+	struct grim_output *output = data;
+
+	output->logical_geometry.width = width;
+	output->logical_geometry.height = height;
+}
+
+static void xdg_output_handle_done(void *data,
+		struct zxdg_output_v1 *xdg_output) {
+	struct grim_output *output = data;
+
+	// Guess the output scale from the logical size
+	int32_t width = output->geometry.width;
+	int32_t height = output->geometry.height;
+	apply_output_transform(output->transform, &width, &height);
+	output->logical_scale = (double)width / output->logical_geometry.width;
+	output->xdg_output_done = true;
+
+	GRIM_PROBE(xdg_output_done, output->name,
+		output->logical_geometry.x, output->logical_geometry.y,
+		output->logical_geometry.width, output->logical_geometry.height);
+}
+
+static void xdg_output_handle_name(void *data,
+		struct zxdg_output_v1 *xdg_output, const char *name) {
+	struct grim_output *output = data;
+	output->name = strdup(name);
+}
+
+static void xdg_output_handle_description(void *data,
+		struct zxdg_output_v1 *xdg_output, const char *name) {
+	// No-op
+}
+
+static const struct zxdg_output_v1_listener xdg_output_listener = {
+	.logical_position = xdg_output_handle_logical_position,
+	.logical_size = xdg_output_handle_logical_size,
+	.done = xdg_output_handle_done,
+	.name = xdg_output_handle_name,
+	.description = xdg_output_handle_description,
+};
+
+
+static void output_handle_geometry(void *data, struct wl_output *wl_output,
+		int32_t x, int32_t y, int32_t physical_width, int32_t physical_height,
+		int32_t subpixel, const char *make, const char *model,
+		int32_t transform) {
+	struct grim_output *output = data;
+
+	output->geometry.x = x;
+	output->geometry.y = y;
+	output->transform = transform;
+}
+
+static void output_handle_mode(void *data, struct wl_output *wl_output,
+		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
+	struct grim_output *output = data;
+
+	if ((flags & WL_OUTPUT_MODE_CURRENT) != 0) {
+		output->geometry.width = width;
+		output->geometry.height = height;
+	}
+}
+
+static void output_handle_done(void *data, struct wl_output *wl_output) {
+	struct grim_output *output = data;
+	output->wl_output_done = true;
+}
+
+static void output_handle_scale(void *data, struct wl_output *wl_output,
+		int32_t factor) {
+	struct grim_output *output = data;
+	output->scale = factor;
+}
+
+static const struct wl_output_listener output_listener = {
+	.geometry = output_handle_geometry,
+	.mode = output_handle_mode,
+	.done = output_handle_done,
+	.scale = output_handle_scale,
+};
+
+
+static void create_xdg_output(struct grim_output *output) {
+	output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
+		output->state->xdg_output_manager, output->wl_output);
+	zxdg_output_v1_add_listener(output->xdg_output, &xdg_output_listener,
+		output);
+}
+
+static void handle_global(void *data, struct wl_registry *registry,
+		uint32_t name, const char *interface, uint32_t version) {
+	struct grim_state *state = data;
+
+	if (strcmp(interface, wl_shm_interface.name) == 0) {
+		state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+		GRIM_PROBE(registry_bind, interface, 1);
+	} else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
+		uint32_t bind_version = (version > 2) ? 2 : version;
+		state->xdg_output_manager = wl_registry_bind(registry, name,
+			&zxdg_output_manager_v1_interface, bind_version);
+		GRIM_PROBE(registry_bind, interface, bind_version);
+	} else if (strcmp(interface, wl_output_interface.name) == 0) {
+		struct grim_output *output = calloc(1, sizeof(struct grim_output));
+		if (output == NULL) {
+			fprintf(stderr, "failed to allocate output\n");
+			return;
+		}
+		output->state = state;
+		output->scale = 1;
+		output->global_name = name;
+		output->wl_output =  wl_registry_bind(registry, name,
+			&wl_output_interface, 3);
+		wl_output_add_listener(output->wl_output, &output_listener, output);
+		wl_list_insert(&state->outputs, &output->link);
+		GRIM_PROBE(registry_bind, interface, 3);
+		// Outputs announced before the manager get theirs in grim_connect()
+		if (state->xdg_output_manager != NULL) {
+			create_xdg_output(output);
+		}
+		// Plugged in after the layout was built: it is built again once
+		// the new output is described
+		state->layout_ready = false;
+	} else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+		state->screencopy_manager = wl_registry_bind(registry, name,
+			&zwlr_screencopy_manager_v1_interface, 1);
+		GRIM_PROBE(registry_bind, interface, 1);
+	} else if (strcmp(interface,
+			ext_image_copy_capture_manager_v1_interface.name) == 0) {
+		state->copy_capture_manager = wl_registry_bind(registry, name,
+			&ext_image_copy_capture_manager_v1_interface, 1);
+		GRIM_PROBE(registry_bind, interface, 1);
+	} else if (strcmp(interface,
+			ext_output_image_capture_source_manager_v1_interface.name) == 0) {
+		state->output_source_manager = wl_registry_bind(registry, name,
+			&ext_output_image_capture_source_manager_v1_interface, 1);
+		GRIM_PROBE(registry_bind, interface, 1);
+	} else if (strcmp(interface,
+			ext_foreign_toplevel_image_capture_source_manager_v1_interface.name) == 0) {
+		state->toplevel_source_manager = wl_registry_bind(registry, name,
+			&ext_foreign_toplevel_image_capture_source_manager_v1_interface, 1);
+		GRIM_PROBE(registry_bind, interface, 1);
+	} else if (strcmp(interface, ext_foreign_toplevel_list_v1_interface.name) == 0) {
+		state->toplevel_list_name = name;
+	}
+}
+
+static void destroy_output(struct grim_output *output) {
+	wl_list_remove(&output->link);
+	free(output->name);
+	if (output->screencopy_frame != NULL) {
+		zwlr_screencopy_frame_v1_destroy(output->screencopy_frame);
+	}
+	destroy_copy_capture(output->copy_capture);
+	destroy_buffer(output->buffer);
+	destroy_buffer(output->spare_buffer);
+	if (output->xdg_output != NULL) {
+		zxdg_output_v1_destroy(output->xdg_output);
+	}
+	if (output->wl_output != NULL) {
+		wl_output_release(output->wl_output);
+	}
+	free(output);
+}
+
+static bool is_output_capturing(struct grim_output *output) {
+	struct grim_copy_capture *capture = output->copy_capture;
+	return output->screencopy_frame != NULL || (capture != NULL &&
+		(capture->frame != NULL || capture->frame_wanted));
+}
+
+static void handle_global_remove(void *data, struct wl_registry *registry,
+		uint32_t name) {
+	struct grim_state *state = data;
+
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->global_name != name) {
+			continue;
+		}
+		if (state->n_done < state->n_pending && is_output_capturing(output)) {
+			fprintf(stderr, "output %s was removed during the capture\n",
+				output->name != NULL ? output->name : "(unnamed)");
+			state->capture_failed = true;
+		}
+		destroy_output(output);
+		// The layout index points at the outputs
+		if (state->layout_ready) {
+			build_output_layout(state);
+		}
+		return;
+	}
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = handle_global,
+	.global_remove = handle_global_remove,
+};
+
+void grim_disconnect(struct grim_state *state) {
+	if (state == NULL) {
+		return;
+	}
+
+	struct grim_output *output, *output_tmp;
+	wl_list_for_each_safe(output, output_tmp, &state->outputs, link) {
+		destroy_output(output);
+	}
+	if (state->screencopy_manager != NULL) {
+		zwlr_screencopy_manager_v1_destroy(state->screencopy_manager);
+	}
+	if (state->copy_capture_manager != NULL) {
+		ext_image_copy_capture_manager_v1_destroy(state->copy_capture_manager);
+	}
+	if (state->output_source_manager != NULL) {
+		ext_output_image_capture_source_manager_v1_destroy(
+			state->output_source_manager);
+	}
+	if (state->toplevel_source_manager != NULL) {
+		ext_foreign_toplevel_image_capture_source_manager_v1_destroy(
+			state->toplevel_source_manager);
+	}
+	if (state->xdg_output_manager != NULL) {
+		zxdg_output_manager_v1_destroy(state->xdg_output_manager);
+	}
+	finish_output_layout(state);
+	if (state->shm != NULL) {
+		wl_shm_destroy(state->shm);
+	}
+	if (state->registry != NULL) {
+		wl_registry_destroy(state->registry);
+	}
+	if (state->display != NULL) {
+		wl_display_disconnect(state->display);
+	}
+	free(state);
+}
+
+struct grim_state *grim_connect(const char *display_name) {
+	struct grim_state *state = calloc(1, sizeof(struct grim_state));
+	if (state == NULL) {
+		fprintf(stderr, "failed to allocate state\n");
+		return NULL;
+	}
+	wl_list_init(&state->outputs);
+
+	state->display = wl_display_connect(display_name);
+	if (state->display == NULL) {
+		fprintf(stderr, "failed to create display\n");
+		grim_disconnect(state);
+		return NULL;
+	}
+
+	state->registry = wl_display_get_registry(state->display);
+	wl_registry_add_listener(state->registry, &registry_listener, state);
+	wl_display_roundtrip(state->display);
+
+	if (state->shm == NULL) {
+		fprintf(stderr, "compositor doesn't support wl_shm\n");
+		grim_disconnect(state);
+		return NULL;
+	}
+	if (wl_list_empty(&state->outputs)) {
+		fprintf(stderr, "no wl_output\n");
+		grim_disconnect(state);
+		return NULL;
+	}
+
+	if (state->screencopy_manager == NULL && !can_copy_capture_outputs(state)) {
+		fprintf(stderr, "compositor doesn't support wlr-screencopy-unstable-v1 "
+			"nor ext-image-copy-capture-v1\n");
+		grim_disconnect(state);
+		return NULL;
+	}
+
+	// The layout is only waited for when needed: these requests go out
+	// along with the first capture requests
+	if (state->xdg_output_manager != NULL) {
+		struct grim_output *output;
+		wl_list_for_each(output, &state->outputs, link) {
+			if (output->xdg_output == NULL) {
+				create_xdg_output(output);
+			}
+		}
+	} else {
+		fprintf(stderr, "warning: zxdg_output_manager_v1 isn't available, "
+			"guessing the output layout\n");
+	}
+
+	return state;
+}
+
+void grim_set_buffer_func(struct grim_state *state, grim_buffer_func func,
+		void *data) {
+	state->buffer_func = func;
+	state->buffer_func_data = data;
+}
+
+void grim_release_buffers(struct grim_state *state) {
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		destroy_buffer(output->spare_buffer);
+		output->spare_buffer = NULL;
+	}
+}
+
+size_t grim_get_buffers_created(struct grim_state *state) {
+	return state->n_buffers_created;
+}
+
+static bool capture_output(struct grim_output *output, bool with_cursor) {
+	struct grim_state *state = output->state;
+	if (can_copy_capture_outputs(state)) {
+		if (output->copy_capture == NULL) {
+			struct ext_image_capture_source_v1 *source =
+				ext_output_image_capture_source_manager_v1_create_source(
+					state->output_source_manager, output->wl_output);
+			output->copy_capture = create_copy_capture(state, output, NULL,
+				source, &output->buffer, &output->spare_buffer);
+			if (output->copy_capture == NULL) {
+				return false;
+			}
+		}
+		copy_capture_start(output->copy_capture, with_cursor);
+		return true;
+	}
+
+	output->screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
+		state->screencopy_manager, with_cursor, output->wl_output);
+	zwlr_screencopy_frame_v1_add_listener(output->screencopy_frame,
+		&screencopy_frame_listener, output);
+	return true;
+}
+
+bool grim_capture_start(struct grim_state *state, const struct grim_box *box,
+		bool with_cursor) {
+	if (state->display == NULL) {
+		fprintf(stderr, "can't capture without a compositor\n");
+		return false;
+	}
+
+	// Frames of the previous capture are kept for reuse, but must not be
+	// rendered again
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->screencopy_frame != NULL) {
+			zwlr_screencopy_frame_v1_destroy(output->screencopy_frame);
+			output->screencopy_frame = NULL;
+		}
+		if (output->copy_capture != NULL) {
+			copy_capture_cancel(output->copy_capture);
+		}
+		if (output->buffer != NULL) {
+			destroy_buffer(output->spare_buffer);
+			output->spare_buffer = output->buffer;
+			output->buffer = NULL;
+		}
+		output->screencopy_frame_flags = 0;
+	}
+	state->n_done = 0;
+	state->capture_failed = false;
+
+	struct grim_output **outputs = NULL;
+	size_t n_pending = 0;
+	if (box != NULL) {
+		// Outputs can only be picked once their position is known
+		if (!ensure_output_layout(state)) {
+			return false;
+		}
+		outputs = calloc(state->layout.n_outputs, sizeof(struct grim_output *));
+		if (outputs == NULL) {
+			fprintf(stderr, "failed to allocate outputs\n");
+			return false;
+		}
+		struct grim_box geometry = *box;
+		n_pending = find_outputs_in_box(state, &geometry, outputs);
+		bool ok = true;
+		for (size_t i = 0; i < n_pending && ok; i++) {
+			ok = capture_output(outputs[i], with_cursor);
+		}
+		free(outputs);
+		if (!ok) {
+			return false;
+		}
+	} else {
+		// Every output is captured, no need to wait for the layout
+		wl_list_for_each(output, &state->outputs, link) {
+			if (!capture_output(output, with_cursor)) {
+				return false;
+			}
+			++n_pending;
+		}
+	}
+
+	state->n_pending = n_pending;
+	if (n_pending == 0) {
+		fprintf(stderr, "supplied geometry did not intersect with any outputs\n");
+		return false;
+	}
+	return true;
+}
+
+static enum grim_capture_status get_capture_status(struct grim_state *state) {
+	if (state->capture_failed) {
+		return GRIM_CAPTURE_FAILED;
+	}
+	if (state->n_done < state->n_pending || !try_output_layout(state)) {
+		return GRIM_CAPTURE_PENDING;
+	}
+	return GRIM_CAPTURE_DONE;
+}
+
+bool grim_capture(struct grim_state *state, const struct grim_box *box,
+		bool with_cursor) {
+	if (!grim_capture_start(state, box, with_cursor)) {
+		return false;
+	}
+
+	enum grim_capture_status status;
+	while ((status = get_capture_status(state)) == GRIM_CAPTURE_PENDING) {
+		if (wl_display_dispatch(state->display) == -1) {
+			status = GRIM_CAPTURE_FAILED;
+			break;
+		}
+	}
+	if (status != GRIM_CAPTURE_DONE) {
+		fprintf(stderr, "failed to screenshoot all outputs\n");
+		return false;
+	}
+	return true;
+}
+
+int grim_prepare_poll(struct grim_state *state, short *events) {
+	while (wl_display_prepare_read(state->display) != 0) {
+		if (wl_display_dispatch_pending(state->display) == -1) {
+			return -1;
+		}
+	}
+
+	*events = POLLIN;
+	if (wl_display_flush(state->display) == -1) {
+		if (errno != EAGAIN) {
+			wl_display_cancel_read(state->display);
+			return -1;
+		}
+		// The socket is full, the rest goes out once it drains
+		*events |= POLLOUT;
+	}
+	return wl_display_get_fd(state->display);
+}
+
+enum grim_capture_status grim_finish_poll(struct grim_state *state,
+		short revents) {
+	if (revents & POLLIN) {
+		if (wl_display_read_events(state->display) == -1) {
+			return GRIM_CAPTURE_FAILED;
+		}
+	} else {
+		wl_display_cancel_read(state->display);
+	}
+	if (wl_display_dispatch_pending(state->display) == -1) {
+		return GRIM_CAPTURE_FAILED;
+	}
+	return get_capture_status(state);
+}
@@ -0,0 +1,305 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "clipboard.h"
+#include "wlr-data-control-unstable-v1-client-protocol.h"
+
+static const char *const mime_types[] = {
+	[GRIM_FILETYPE_PNG] = "image/png",
+	[GRIM_FILETYPE_PPM] = "image/x-portable-pixmap",
+	[GRIM_FILETYPE_JPEG] = "image/jpeg",
+	[GRIM_FILETYPE_WEBP] = "image/webp",
+};
+
+#define N_FILETYPES (sizeof(mime_types) / sizeof(mime_types[0]))
+
+struct clipboard_data {
+	char *data;
+	size_t size, cap;
+	bool encoded;
+};
+
+struct grim_clipboard {
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_seat *seat;
+	struct zwlr_data_control_manager_v1 *data_control_manager;
+	struct zwlr_data_control_device_v1 *data_control_device;
+	struct zwlr_data_control_source_v1 *data_control_source;
+
+	pixman_image_t *image;
+	struct grim_encode_options options;
+	// Encoded images by filetype, the others are encoded when first pasted
+	struct clipboard_data data[N_FILETYPES];
+	bool running;
+};
+
+static int write_data(void *data, const void *buf, size_t len) {
+	struct clipboard_data *clipboard_data = data;
+	if (clipboard_data->size + len > clipboard_data->cap) {
+		size_t cap = clipboard_data->cap > 0 ? clipboard_data->cap : 4096;
+		while (clipboard_data->size + len > cap) {
+			cap *= 2;
+		}
+		char *new_data = realloc(clipboard_data->data, cap);
+		if (new_data == NULL) {
+			fprintf(stderr, "failed to allocate clipboard data\n");
+			return -1;
+		}
+		clipboard_data->data = new_data;
+		clipboard_data->cap = cap;
+	}
+	memcpy(clipboard_data->data + clipboard_data->size, buf, len);
+	clipboard_data->size += len;
+	return 0;
+}
+
+static struct clipboard_data *get_data(struct grim_clipboard *clipboard,
+		enum grim_filetype filetype) {
+	struct clipboard_data *data = &clipboard->data[filetype];
+	if (data->encoded) {
+		return data;
+	}
+
+	struct grim_encode_options options;
+	if (filetype == clipboard->options.filetype) {
+		options = clipboard->options;
+	} else {
+		grim_init_encode_options(&options, filetype);
+	}
+	data->size = 0;
+	if (grim_encode(clipboard->image, &options, write_data, data) != 0) {
+		return NULL;
+	}
+	data->encoded = true;
+	return data;
+}
+
+static void write_fd(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// The pasting client went away, nothing to do about it
+			if (errno != EPIPE) {
+				fprintf(stderr, "failed to send clipboard data: %s\n",
+					strerror(errno));
+			}
+			return;
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+static void source_handle_send(void *data,
+		struct zwlr_data_control_source_v1 *source, const char *mime_type,
+		int32_t fd) {
+	struct grim_clipboard *clipboard = data;
+
+	for (size_t i = 0; i < N_FILETYPES; i++) {
+		if (strcmp(mime_type, mime_types[i]) != 0) {
+			continue;
+		}
+		struct clipboard_data *clipboard_data = get_data(clipboard, i);
+		if (clipboard_data != NULL) {
+			write_fd(fd, clipboard_data->data, clipboard_data->size);
+		}
+		break;
+	}
+	close(fd);
+}
+
+static void source_handle_cancelled(void *data,
+		struct zwlr_data_control_source_v1 *source) {
+	struct grim_clipboard *clipboard = data;
+	clipboard->running = false;
+}
+
+static const struct zwlr_data_control_source_v1_listener source_listener = {
+	.send = source_handle_send,
+	.cancelled = source_handle_cancelled,
+};
+
+static void device_handle_data_offer(void *data,
+		struct zwlr_data_control_device_v1 *device,
+		struct zwlr_data_control_offer_v1 *offer) {
+	// Destroyed along with the selection event introducing it
+}
+
+static void device_handle_selection(void *data,
+		struct zwlr_data_control_device_v1 *device,
+		struct zwlr_data_control_offer_v1 *offer) {
+	if (offer != NULL) {
+		zwlr_data_control_offer_v1_destroy(offer);
+	}
+}
+
+static void device_handle_finished(void *data,
+		struct zwlr_data_control_device_v1 *device) {
+	struct grim_clipboard *clipboard = data;
+	clipboard->running = false;
+}
+
+static const struct zwlr_data_control_device_v1_listener device_listener = {
+	.data_offer = device_handle_data_offer,
+	.selection = device_handle_selection,
+	.finished = device_handle_finished,
+};
+
+static void handle_global(void *data, struct wl_registry *registry,
+		uint32_t name, const char *interface, uint32_t version) {
+	struct grim_clipboard *clipboard = data;
+
+	if (strcmp(interface, wl_seat_interface.name) == 0) {
+		// Only the first seat gets the selection
+		if (clipboard->seat == NULL) {
+			clipboard->seat = wl_registry_bind(registry, name,
+				&wl_seat_interface, 1);
+		}
+	} else if (strcmp(interface,
+			zwlr_data_control_manager_v1_interface.name) == 0) {
+		clipboard->data_control_manager = wl_registry_bind(registry, name,
+			&zwlr_data_control_manager_v1_interface, 1);
+	}
+}
+
+static void handle_global_remove(void *data, struct wl_registry *registry,
+		uint32_t name) {
+	// who cares
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = handle_global,
+	.global_remove = handle_global_remove,
+};
+
+struct grim_clipboard *clipboard_offer(const char *display_name,
+		pixman_image_t *image, const struct grim_encode_options *options) {
+	struct grim_clipboard *clipboard = calloc(1, sizeof(*clipboard));
+	if (clipboard == NULL) {
+		fprintf(stderr, "failed to allocate clipboard\n");
+		return NULL;
+	}
+	clipboard->image = pixman_image_ref(image);
+	clipboard->options = *options;
+
+	// Encode the requested filetype right away, so that errors are
+	// reported before going to the background and the first paste is
+	// served straight from memory
+	if (get_data(clipboard, options->filetype) == NULL) {
+		clipboard_destroy(clipboard);
+		return NULL;
+	}
+
+	clipboard->display = wl_display_connect(display_name);
+	if (clipboard->display == NULL) {
+		fprintf(stderr, "failed to create display\n");
+		clipboard_destroy(clipboard);
+		return NULL;
+	}
+
+	clipboard->registry = wl_display_get_registry(clipboard->display);
+	wl_registry_add_listener(clipboard->registry, &registry_listener,
+		clipboard);
+	if (wl_display_roundtrip(clipboard->display) < 0) {
+		fprintf(stderr, "wl_display_roundtrip() failed\n");
+		clipboard_destroy(clipboard);
+		return NULL;
+	}
+
+	if (clipboard->seat == NULL) {
+		fprintf(stderr, "no seat to set the selection of\n");
+		clipboard_destroy(clipboard);
+		return NULL;
+	}
+	if (clipboard->data_control_manager == NULL) {
+		fprintf(stderr, "compositor doesn't support wlr-data-control-unstable-v1\n");
+		clipboard_destroy(clipboard);
+		return NULL;
+	}
+
+	clipboard->data_control_device =
+		zwlr_data_control_manager_v1_get_data_device(
+		clipboard->data_control_manager, clipboard->seat);
+	zwlr_data_control_device_v1_add_listener(clipboard->data_control_device,
+		&device_listener, clipboard);
+
+	clipboard->data_control_source =
+		zwlr_data_control_manager_v1_create_data_source(
+		clipboard->data_control_manager);
+	zwlr_data_control_source_v1_add_listener(clipboard->data_control_source,
+		&source_listener, clipboard);
+	// Preferred filetype first
+	zwlr_data_control_source_v1_offer(clipboard->data_control_source,
+		mime_types[options->filetype]);
+	for (size_t i = 0; i < N_FILETYPES; i++) {
+		// Only the filetypes which can be encoded when pasted
+		if (i != options->filetype && grim_filetype_available(i)) {
+			zwlr_data_control_source_v1_offer(
+				clipboard->data_control_source, mime_types[i]);
+		}
+	}
+	zwlr_data_control_device_v1_set_selection(clipboard->data_control_device,
+		clipboard->data_control_source);
+
+	if (wl_display_roundtrip(clipboard->display) < 0) {
+		fprintf(stderr, "failed to set the selection\n");
+		clipboard_destroy(clipboard);
+		return NULL;
+	}
+	clipboard->running = true;
+	return clipboard;
+}
+
+bool clipboard_serve(struct grim_clipboard *clipboard) {
+	// Pasting clients closing the pipe early mustn't kill us
+	signal(SIGPIPE, SIG_IGN);
+
+	while (clipboard->running) {
+		if (wl_display_dispatch(clipboard->display) == -1) {
+			fprintf(stderr, "lost the connection while serving the selection\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+void clipboard_destroy(struct grim_clipboard *clipboard) {
+	if (clipboard == NULL) {
+		return;
+	}
+
+	if (clipboard->data_control_source != NULL) {
+		zwlr_data_control_source_v1_destroy(clipboard->data_control_source);
+	}
+	if (clipboard->data_control_device != NULL) {
+		zwlr_data_control_device_v1_destroy(clipboard->data_control_device);
+	}
+	if (clipboard->data_control_manager != NULL) {
+		zwlr_data_control_manager_v1_destroy(
+			clipboard->data_control_manager);
+	}
+	if (clipboard->seat != NULL) {
+		wl_seat_destroy(clipboard->seat);
+	}
+	if (clipboard->registry != NULL) {
+		wl_registry_destroy(clipboard->registry);
+	}
+	if (clipboard->display != NULL) {
+		wl_display_disconnect(clipboard->display);
+	}
+	for (size_t i = 0; i < N_FILETYPES; i++) {
+		free(clipboard->data[i].data);
+	}
+	pixman_image_unref(clipboard->image);
+	free(clipboard);
+}
@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compare.h"
+
+#define DIFF_CHANGED 0xffff0000 // opaque red
+
+static bool is_masked(const struct compare_options *options, int32_t x,
+		int32_t y) {
+	for (size_t i = 0; i < options->n_masks; i++) {
+		const struct grim_box *mask = &options->masks[i];
+		if (x >= mask->x && x < mask->x + mask->width &&
+				y >= mask->y && y < mask->y + mask->height) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool pixel_changed(uint32_t a, uint32_t b, uint32_t channels,
+		int tolerance) {
+	uint32_t delta = (a ^ b) & channels;
+	if (delta == 0 || tolerance == 0) {
+		return delta != 0;
+	}
+	for (int shift = 0; shift < 32; shift += 8) {
+		if (((channels >> shift) & 0xff) == 0) {
+			continue;
+		}
+		int ca = (a >> shift) & 0xff;
+		int cb = (b >> shift) & 0xff;
+		if (abs(ca - cb) > tolerance) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static uint32_t dim_pixel(uint32_t p) {
+	return (p & 0xff000000) | ((p >> 2) & 0x003f3f3f);
+}
+
+void compare_images(pixman_image_t *image, pixman_image_t *ref,
+		const struct compare_options *options, pixman_image_t *diff,
+		struct compare_result *result) {
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	int ref_stride = pixman_image_get_stride(ref);
+	const uint8_t *data = (const uint8_t *)pixman_image_get_data(image);
+	const uint8_t *ref_data = (const uint8_t *)pixman_image_get_data(ref);
+	uint8_t *diff_data = NULL;
+	int diff_stride = 0;
+	if (diff != NULL) {
+		diff_data = (uint8_t *)pixman_image_get_data(diff);
+		diff_stride = pixman_image_get_stride(diff);
+	}
+
+	uint32_t channels = 0xffffffff;
+	if (pixman_image_get_format(ref) == PIXMAN_x8r8g8b8) {
+		channels = 0x00ffffff;
+	}
+
+	uint64_t n_changed = 0;
+	int32_t x1 = width, y1 = height, x2 = 0, y2 = 0;
+	for (int y = 0; y < height; y++) {
+		const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+		const uint32_t *ref_row =
+			(const uint32_t *)(ref_data + (size_t)y * ref_stride);
+		uint32_t *diff_row = NULL;
+		if (diff_data != NULL) {
+			diff_row = (uint32_t *)(diff_data + (size_t)y * diff_stride);
+			for (int x = 0; x < width; x++) {
+				diff_row[x] = dim_pixel(row[x]);
+			}
+		}
+
+		// Identical rows are by far the most common, and memcmp() is
+		// as fast as it gets at finding them
+		if (memcmp(row, ref_row, (size_t)width * 4) == 0) {
+			continue;
+		}
+
+		for (int x = 0; x < width; x++) {
+			if (!pixel_changed(row[x], ref_row[x], channels,
+					options->tolerance) || is_masked(options, x, y)) {
+				continue;
+			}
+			++n_changed;
+			x1 = x < x1 ? x : x1;
+			x2 = x + 1 > x2 ? x + 1 : x2;
+			y1 = y < y1 ? y : y1;
+			y2 = y + 1;
+			if (diff_row != NULL) {
+				diff_row[x] = DIFF_CHANGED;
+			}
+		}
+	}
+
+	result->n_changed = n_changed;
+	if (n_changed > 0) {
+		result->bounds = (struct grim_box){ x1, y1, x2 - x1, y2 - y1 };
+	} else {
+		result->bounds = (struct grim_box){0};
+	}
+}
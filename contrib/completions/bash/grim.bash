@@ -6,7 +6,13 @@ _grim() {
 	PREV="${COMP_WORDS[COMP_CWORD-1]}"
 
 	if [[ "$PREV" == "-t" ]]; then
-		COMPREPLY=($(compgen -W "png ppm jpeg" -- "$CUR"))
+		COMPREPLY=($(compgen -W "png ppm jpeg webp" -- "$CUR"))
+		return
+	elif [[ "$PREV" == "--scale-quality" ]]; then
+		COMPREPLY=($(compgen -W "fast good best" -- "$CUR"))
+		return
+	elif [[ "$PREV" == "--sync" ]]; then
+		COMPREPLY=($(compgen -W "fsync range" -- "$CUR"))
 		return
 	elif [[ "$PREV" == "-o" ]]; then
 		local OUTPUTS
@@ -18,7 +24,7 @@ _grim() {
 	fi
 
 	if [[ "$CUR" == -* ]]; then
-		COMPREPLY=($(compgen -W "-h -s -g -t -q -o -c" -- "$CUR"))
+		COMPREPLY=($(compgen -W "-h -s -g -t -q -o -T -c -d -m --deadline --scale-quality --freeze --display --clipboard --dump --from-dump --memory-budget --skip-unchanged --compare --tolerance --mask --frames --interval --tiles --direct --sync --bench" -- "$CUR"))
 		return
 	fi
 
@@ -6,10 +6,31 @@ function complete_outputs
     end
 end
 
-complete -c grim -s t --exclusive --arguments 'png ppm jpeg' -d 'Output image format'
-complete -c grim -s q --exclusive -d 'Output jpeg quality (default 80)'
+complete -c grim -s t --exclusive --arguments 'png ppm jpeg webp' -d 'Output image format'
+complete -c grim -s q --exclusive -d 'Output jpeg/webp quality (default 80)'
 complete -c grim -s g --exclusive -d 'Region to capture: <x>,<y> <w>x<h>'
+complete -c grim -l frames --exclusive -d 'Number of frames of an animated PNG'
+complete -c grim -l interval --exclusive -d 'Time between frames, in ms'
+complete -c grim -l tiles --exclusive --arguments '(__fish_complete_directories)' -d 'Write a Deep Zoom tile pyramid to this directory'
+complete -c grim -l direct -d 'Write the output file with O_DIRECT'
+complete -c grim -l sync --exclusive --arguments 'fsync range' -d 'Sync the output file to disk before exiting'
+complete -c grim -l bench --exclusive -d 'Measure n capture, render and encode cycles'
 complete -c grim -s s --exclusive -d 'Output image scale factor'
 complete -c grim -s c -d 'Include cursors in the screenshot'
+complete -c grim -s d -d 'Detach after capture, before encoding'
+complete -c grim -s m --exclusive -d 'Send the raw image in a memfd over a UNIX socket'
+complete -c grim -l deadline --exclusive -d 'Encoding time budget in milliseconds'
+complete -c grim -l scale-quality --exclusive --arguments 'fast good best' -d 'Downscaling filter quality'
+complete -c grim -l freeze -d 'Capture before reading the geometry'
+complete -c grim -l display --exclusive -d 'Wayland display to capture, can be repeated'
+complete -c grim -l clipboard -d 'Copy to the clipboard instead of writing a file'
+complete -c grim -l dump --exclusive --arguments '(__fish_complete_directories)' -d 'Save the captured frames to a directory'
+complete -c grim -l from-dump --exclusive --arguments '(__fish_complete_directories)' -d 'Render frames saved with --dump'
+complete -c grim -l memory-budget --exclusive -d 'Memory for rendering large images in bands, in MiB'
+complete -c grim -l skip-unchanged -r -d 'Exit with status 2 if the image matches the hash in this file'
+complete -c grim -l compare -r -d 'Reference image to compare with'
+complete -c grim -l tolerance --exclusive -d 'Channel difference ignored when comparing'
+complete -c grim -l mask --exclusive -d 'Region ignored when comparing: <x>,<y> <w>x<h>'
 complete -c grim -s h -d 'Show help and exit'
 complete -c grim -s o --exclusive --arguments '(complete_outputs)' -d 'Output name to capture'
+complete -c grim -s T --exclusive -d 'Identifier of the window to capture'
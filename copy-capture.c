@@ -0,0 +1,303 @@
+#include <limits.h>
+#include <pixman.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer.h"
+#include "copy-capture.h"
+#include "probes.h"
+#include "render.h"
+
+// Frames failing because the constraints changed under them are retried
+// with new buffers that many times
+#define MAX_RETRIES 3
+
+static const char *capture_name(struct grim_copy_capture *capture) {
+	if (capture->output != NULL) {
+		return capture->output->name;
+	}
+	return capture->name;
+}
+
+static void fail_capture(struct grim_copy_capture *capture) {
+	GRIM_PROBE(frame_failed, capture_name(capture));
+	capture->state->capture_failed = true;
+}
+
+static void start_frame(struct grim_copy_capture *capture);
+
+static void frame_handle_transform(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t transform) {
+	struct grim_copy_capture *capture = data;
+	capture->transform = transform;
+}
+
+static void frame_handle_damage(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, int32_t x, int32_t y,
+		int32_t width, int32_t height) {
+	// No-op, the whole frame is read
+}
+
+static void frame_handle_presentation_time(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec) {
+	// No-op
+}
+
+static void frame_handle_ready(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame) {
+	struct grim_copy_capture *capture = data;
+	GRIM_PROBE(frame_ready, capture_name(capture), (*capture->buffer)->width,
+		(*capture->buffer)->height, (*capture->buffer)->size);
+
+	ext_image_copy_capture_frame_v1_destroy(capture->frame);
+	capture->frame = NULL;
+	capture->retries = 0;
+	++capture->state->n_done;
+}
+
+static void frame_handle_failed(void *data,
+		struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason) {
+	struct grim_copy_capture *capture = data;
+	ext_image_copy_capture_frame_v1_destroy(capture->frame);
+	capture->frame = NULL;
+
+	if (reason == EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS &&
+			capture->retries < MAX_RETRIES) {
+		// New constraints are on their way, if not already there
+		capture->retries++;
+		if (capture->constraints_done) {
+			start_frame(capture);
+		} else {
+			capture->frame_wanted = true;
+		}
+		return;
+	}
+
+	fprintf(stderr, "failed to copy %s (reason %u)\n", capture_name(capture),
+		reason);
+	fail_capture(capture);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
+	.transform = frame_handle_transform,
+	.damage = frame_handle_damage,
+	.presentation_time = frame_handle_presentation_time,
+	.ready = frame_handle_ready,
+	.failed = frame_handle_failed,
+};
+
+// Constraint events following a done event start a new set
+static void begin_constraints(struct grim_copy_capture *capture) {
+	if (capture->constraints_done) {
+		capture->constraints_done = false;
+		capture->has_shm_format = false;
+	}
+}
+
+static void session_handle_buffer_size(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t width,
+		uint32_t height) {
+	struct grim_copy_capture *capture = data;
+	begin_constraints(capture);
+	capture->width = width;
+	capture->height = height;
+}
+
+// Formats pixman can read, preferring the ones every compositor supports
+// and the rotation fast path handles
+static int rank_shm_format(uint32_t format) {
+	if (format == WL_SHM_FORMAT_ARGB8888 || format == WL_SHM_FORMAT_XRGB8888) {
+		return 2;
+	}
+	return get_pixman_format(format) != 0 ? 1 : 0;
+}
+
+static void session_handle_shm_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format) {
+	struct grim_copy_capture *capture = data;
+	begin_constraints(capture);
+	if (rank_shm_format(format) > 0 && (!capture->has_shm_format ||
+			rank_shm_format(format) > rank_shm_format(capture->shm_format))) {
+		capture->shm_format = format;
+		capture->has_shm_format = true;
+	}
+}
+
+static void session_handle_dmabuf_device(void *data,
+		struct ext_image_copy_capture_session_v1 *session,
+		struct wl_array *device) {
+	struct grim_copy_capture *capture = data;
+	begin_constraints(capture);
+}
+
+static void session_handle_dmabuf_format(void *data,
+		struct ext_image_copy_capture_session_v1 *session, uint32_t format,
+		struct wl_array *modifiers) {
+	struct grim_copy_capture *capture = data;
+	begin_constraints(capture);
+}
+
+static void session_handle_done(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct grim_copy_capture *capture = data;
+	capture->constraints_done = true;
+	if (capture->frame_wanted) {
+		start_frame(capture);
+	}
+}
+
+static void session_handle_stopped(void *data,
+		struct ext_image_copy_capture_session_v1 *session) {
+	struct grim_copy_capture *capture = data;
+	// Recreated on the next capture
+	capture->stopped = true;
+	if (capture->frame_wanted) {
+		capture->frame_wanted = false;
+		fprintf(stderr, "capture of %s stopped\n", capture_name(capture));
+		fail_capture(capture);
+	}
+	// A frame in flight gets a failed event
+}
+
+static const struct ext_image_copy_capture_session_v1_listener session_listener = {
+	.buffer_size = session_handle_buffer_size,
+	.shm_format = session_handle_shm_format,
+	.dmabuf_device = session_handle_dmabuf_device,
+	.dmabuf_format = session_handle_dmabuf_format,
+	.done = session_handle_done,
+	.stopped = session_handle_stopped,
+};
+
+static void start_frame(struct grim_copy_capture *capture) {
+	capture->frame_wanted = false;
+	if (!capture->has_shm_format) {
+		fprintf(stderr, "no supported shm format to copy %s\n",
+			capture_name(capture));
+		fail_capture(capture);
+		return;
+	}
+
+	pixman_format_code_t pixman_fmt = get_pixman_format(capture->shm_format);
+	uint32_t bytes_per_pixel = PIXMAN_FORMAT_BPP(pixman_fmt) / 8;
+	if (capture->width == 0 || capture->height == 0 ||
+			capture->width > (INT32_MAX - 3) / bytes_per_pixel ||
+			capture->height > INT32_MAX) {
+		fprintf(stderr, "invalid buffer size %ux%u to copy %s\n",
+			capture->width, capture->height, capture_name(capture));
+		fail_capture(capture);
+		return;
+	}
+	// Rows are 32-bit aligned, which pixman needs for 8, 16 and 24-bit
+	// formats
+	uint32_t stride = (capture->width * bytes_per_pixel + 3) & ~(uint32_t)3;
+	GRIM_PROBE(frame_buffer, capture_name(capture), capture->shm_format,
+		capture->width, capture->height, stride);
+
+	// The previous attempt's buffer, if any, is reused when it still fits
+	if (*capture->buffer != NULL) {
+		destroy_buffer(*capture->spare_buffer);
+		*capture->spare_buffer = *capture->buffer;
+		*capture->buffer = NULL;
+	}
+	struct grim_buffer *buffer = get_frame_buffer(capture->state,
+		capture->output, capture->spare_buffer, capture->shm_format,
+		capture->width, capture->height, stride);
+	if (buffer == NULL) {
+		fprintf(stderr, "failed to create buffer\n");
+		fail_capture(capture);
+		return;
+	}
+	*capture->buffer = buffer;
+
+	capture->transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	capture->frame =
+		ext_image_copy_capture_session_v1_create_frame(capture->session);
+	ext_image_copy_capture_frame_v1_add_listener(capture->frame,
+		&frame_listener, capture);
+	ext_image_copy_capture_frame_v1_attach_buffer(capture->frame,
+		buffer->wl_buffer);
+	// Damage isn't tracked, the buffer may hold anything
+	ext_image_copy_capture_frame_v1_damage_buffer(capture->frame, 0, 0,
+		buffer->width, buffer->height);
+	ext_image_copy_capture_frame_v1_capture(capture->frame);
+}
+
+static void destroy_session(struct grim_copy_capture *capture) {
+	copy_capture_cancel(capture);
+	if (capture->session != NULL) {
+		ext_image_copy_capture_session_v1_destroy(capture->session);
+		capture->session = NULL;
+	}
+	capture->stopped = false;
+	capture->has_shm_format = false;
+	capture->constraints_done = false;
+}
+
+bool can_copy_capture_outputs(struct grim_state *state) {
+	return state->copy_capture_manager != NULL &&
+		state->output_source_manager != NULL;
+}
+
+struct grim_copy_capture *create_copy_capture(struct grim_state *state,
+		struct grim_output *output, const char *name,
+		struct ext_image_capture_source_v1 *source, struct grim_buffer **buffer,
+		struct grim_buffer **spare_buffer) {
+	struct grim_copy_capture *capture = calloc(1, sizeof(*capture));
+	if (capture == NULL) {
+		fprintf(stderr, "failed to allocate capture\n");
+		ext_image_capture_source_v1_destroy(source);
+		return NULL;
+	}
+	capture->state = state;
+	capture->output = output;
+	capture->name = name;
+	capture->source = source;
+	capture->buffer = buffer;
+	capture->spare_buffer = spare_buffer;
+	return capture;
+}
+
+void destroy_copy_capture(struct grim_copy_capture *capture) {
+	if (capture == NULL) {
+		return;
+	}
+	destroy_session(capture);
+	ext_image_capture_source_v1_destroy(capture->source);
+	free(capture);
+}
+
+void copy_capture_start(struct grim_copy_capture *capture, bool with_cursor) {
+	copy_capture_cancel(capture);
+	if (capture->session != NULL &&
+			(capture->stopped || capture->with_cursor != with_cursor)) {
+		destroy_session(capture);
+	}
+
+	capture->retries = 0;
+	if (capture->session == NULL) {
+		uint32_t options = 0;
+		if (with_cursor) {
+			options |= EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_OPTIONS_PAINT_CURSORS;
+		}
+		capture->with_cursor = with_cursor;
+		capture->session = ext_image_copy_capture_manager_v1_create_session(
+			capture->state->copy_capture_manager, capture->source, options);
+		ext_image_copy_capture_session_v1_add_listener(capture->session,
+			&session_listener, capture);
+	}
+
+	if (capture->constraints_done) {
+		start_frame(capture);
+	} else {
+		capture->frame_wanted = true;
+	}
+}
+
+void copy_capture_cancel(struct grim_copy_capture *capture) {
+	capture->frame_wanted = false;
+	if (capture->frame != NULL) {
+		ext_image_copy_capture_frame_v1_destroy(capture->frame);
+		capture->frame = NULL;
+	}
+}
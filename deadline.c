@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "deadline.h"
+
+// The sample is made of a few full-width bands spread over the image, since
+// content (and so compression speed) varies a lot from top to bottom
+#define SAMPLE_BANDS 4
+#define SAMPLE_MIN_BAND_HEIGHT 16
+#define SAMPLE_FRACTION 64
+
+struct sampler {
+	pixman_image_t *bands[SAMPLE_BANDS];
+	size_t n_bands;
+	int sample_rows, total_rows;
+};
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Trials only need the size of the output
+static int count_write(void *data, const void *buf, size_t len) {
+	return 0;
+}
+
+static void init_sampler(struct sampler *sampler, pixman_image_t *image) {
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	pixman_format_code_t format = pixman_image_get_format(image);
+	unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+
+	sampler->total_rows = height;
+
+	int band_height = height / SAMPLE_FRACTION;
+	if (band_height < SAMPLE_MIN_BAND_HEIGHT) {
+		band_height = SAMPLE_MIN_BAND_HEIGHT;
+	}
+	if (band_height * SAMPLE_BANDS >= height) {
+		// Small enough to try on the whole image
+		sampler->bands[0] = pixman_image_ref(image);
+		sampler->n_bands = 1;
+		sampler->sample_rows = height;
+		return;
+	}
+
+	sampler->n_bands = 0;
+	sampler->sample_rows = 0;
+	for (int i = 0; i < SAMPLE_BANDS; i++) {
+		int y = (height - band_height) * i / (SAMPLE_BANDS - 1);
+		// Bands share the image's pixels, nothing is copied
+		pixman_image_t *band = pixman_image_create_bits(format, width,
+			band_height, (uint32_t *)(data + (size_t)y * stride), stride);
+		if (band == NULL) {
+			continue;
+		}
+		sampler->bands[sampler->n_bands++] = band;
+		sampler->sample_rows += band_height;
+	}
+}
+
+static void finish_sampler(struct sampler *sampler) {
+	for (size_t i = 0; i < sampler->n_bands; i++) {
+		pixman_image_unref(sampler->bands[i]);
+	}
+}
+
+static bool run_trial(struct sampler *sampler, encode_func encode,
+		const void *params, struct trial_result *result) {
+	if (sampler->sample_rows == 0) {
+		return false;
+	}
+
+	struct grim_sink sink = { .write = count_write };
+	double start = now_ms();
+	for (size_t i = 0; i < sampler->n_bands; i++) {
+		if (encode(sampler->bands[i], &sink, params) != 0) {
+			return false;
+		}
+	}
+	double elapsed = now_ms() - start;
+	size_t total_size = sink.written;
+
+	double factor = (double)sampler->total_rows / sampler->sample_rows;
+	result->time_ms = elapsed * factor;
+	result->size = total_size * factor;
+	return true;
+}
+
+size_t choose_candidate(pixman_image_t *image, long deadline_ms,
+		encode_func encode, const void *candidates, size_t params_size,
+		size_t n_candidates, struct trial_result *chosen_result) {
+	struct sampler sampler;
+	init_sampler(&sampler, image);
+
+	double start = now_ms();
+	size_t chosen = 0;
+	*chosen_result = (struct trial_result){0};
+	for (size_t i = 0; i < n_candidates; i++) {
+		const void *params = (const char *)candidates + i * params_size;
+		struct trial_result result;
+		if (!run_trial(&sampler, encode, params, &result)) {
+			break;
+		}
+
+		// Trials eat into the budget too
+		double remaining_ms = deadline_ms - (now_ms() - start);
+		if (i > 0 && result.time_ms > remaining_ms) {
+			// Slower candidates won't fit either
+			break;
+		}
+		if (i == 0 || result.size < chosen_result->size) {
+			chosen = i;
+			*chosen_result = result;
+		}
+	}
+
+	finish_sampler(&sampler);
+	return chosen;
+}
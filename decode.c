@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libgrim.h"
+#include "writer.h"
+
+static const unsigned char png_signature[] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+};
+
+// Skips whitespace and comments, then reads a decimal number
+static bool read_ppm_number(FILE *file, int *value) {
+	int c;
+	while ((c = fgetc(file)) != EOF) {
+		if (c == '#') {
+			while ((c = fgetc(file)) != EOF && c != '\n') {
+				// skip comment
+			}
+		} else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+			break;
+		}
+	}
+
+	long n = 0;
+	if (c < '0' || c > '9') {
+		return false;
+	}
+	while (c >= '0' && c <= '9') {
+		n = n * 10 + (c - '0');
+		if (n > INT_MAX) {
+			return false;
+		}
+		c = fgetc(file);
+	}
+	// A single whitespace character ends the number
+	*value = n;
+	return c != EOF;
+}
+
+static pixman_image_t *read_ppm(FILE *file) {
+	int width, height, maxval;
+	if (fgetc(file) != 'P' || fgetc(file) != '6' ||
+			!read_ppm_number(file, &width) ||
+			!read_ppm_number(file, &height) ||
+			!read_ppm_number(file, &maxval)) {
+		fprintf(stderr, "invalid ppm header\n");
+		return NULL;
+	}
+	if (maxval != 255) {
+		fprintf(stderr, "only 8-bit ppm images are supported\n");
+		return NULL;
+	}
+	if (width <= 0 || height <= 0 ||
+			(size_t)width * height > INT_MAX / 4) {
+		fprintf(stderr, "invalid ppm size %dx%d\n", width, height);
+		return NULL;
+	}
+
+	pixman_image_t *image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+		width, height, NULL, 0);
+	unsigned char *row = malloc((size_t)width * 3);
+	if (image == NULL || row == NULL) {
+		fprintf(stderr, "failed to allocate image\n");
+		goto error;
+	}
+
+	uint8_t *data = (uint8_t *)pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image);
+	for (int y = 0; y < height; y++) {
+		if (fread(row, 3, width, file) != (size_t)width) {
+			fprintf(stderr, "truncated ppm image\n");
+			goto error;
+		}
+		uint32_t *pixels = (uint32_t *)(data + (size_t)y * stride);
+		for (int x = 0; x < width; x++) {
+			const unsigned char *p = &row[x * 3];
+			pixels[x] = 0xffu << 24 | (uint32_t)p[0] << 16 |
+				(uint32_t)p[1] << 8 | p[2];
+		}
+	}
+	free(row);
+	return image;
+
+error:
+	free(row);
+	if (image != NULL) {
+		pixman_image_unref(image);
+	}
+	return NULL;
+}
+
+pixman_image_t *grim_load_image(const char *path) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "failed to open '%s': %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	unsigned char magic[sizeof(png_signature)] = {0};
+	size_t n = fread(magic, 1, sizeof(magic), file);
+	rewind(file);
+
+	pixman_image_t *image = NULL;
+	if (n >= 2 && magic[0] == 'P' && magic[1] == '6') {
+		image = read_ppm(file);
+	} else if (n == sizeof(magic) &&
+			memcmp(magic, png_signature, sizeof(magic)) == 0) {
+		const struct grim_writer *writer = get_writer(GRIM_FILETYPE_PNG);
+		if (writer != NULL && writer->decode != NULL) {
+			image = writer->decode(file);
+		}
+	} else {
+		fprintf(stderr, "'%s' is neither a png nor a ppm image\n", path);
+	}
+	fclose(file);
+	return image;
+}
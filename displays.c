@@ -0,0 +1,226 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "displays.h"
+#include "pool.h"
+
+struct display_job {
+	const struct displays_config *config;
+	const char *name;
+	struct grim_state *state;
+	char *path;
+	bool pending; // capture in progress
+	bool ok;
+};
+
+// "dir/file.png" becomes "dir/<display>-file.png", where <display> is the
+// last component of the display name, which can be a socket path
+static char *get_display_path(const char *path, const char *display_name) {
+	const char *display = strrchr(display_name, '/');
+	display = display != NULL ? display + 1 : display_name;
+	const char *file = strrchr(path, '/');
+	size_t dir_len = file != NULL ? (size_t)(file + 1 - path) : 0;
+
+	size_t len = strlen(path) + strlen(display) + 2;
+	char *display_path = malloc(len);
+	if (display_path == NULL) {
+		return NULL;
+	}
+	snprintf(display_path, len, "%.*s%s-%s", (int)dir_len, path, display,
+		path + dir_len);
+	return display_path;
+}
+
+static bool render_display(struct display_job *job) {
+	const struct displays_config *config = job->config;
+	struct grim_state *state = job->state;
+
+	struct grim_box geometry;
+	if (config->output_name != NULL) {
+		struct grim_output *output =
+			grim_find_output(state, config->output_name);
+		if (output == NULL) {
+			fprintf(stderr, "%s: unknown output '%s'\n", job->name,
+				config->output_name);
+			return false;
+		}
+		grim_output_get_logical_geometry(output, &geometry);
+	} else if (config->geometry != NULL) {
+		geometry = *config->geometry;
+	} else {
+		grim_get_layout_extents(state, &geometry);
+	}
+
+	double scale = config->scale;
+	if (scale <= 0) {
+		scale = grim_get_greatest_scale(state, &geometry);
+		if (scale < 1.0) {
+			scale = 1.0;
+		}
+	}
+
+	pixman_image_t *image = grim_render(state, &geometry, scale);
+	// Frames aren't needed anymore, let the memory go before encoding
+	grim_disconnect(state);
+	job->state = NULL;
+	if (image == NULL) {
+		return false;
+	}
+
+	bool ok = false;
+	struct output_file *file = output_file_open(job->path,
+		&config->file_options);
+	if (file != NULL) {
+		ok = grim_encode(image, &config->encode_options, output_file_write,
+			file) == 0;
+		if (!output_file_close(file)) {
+			ok = false;
+		}
+	}
+
+	pixman_image_unref(image);
+	return ok;
+}
+
+static void process_display(void *data) {
+	struct display_job *job = data;
+	job->ok = render_display(job);
+}
+
+static void fail_display(struct display_job *job) {
+	fprintf(stderr, "%s: failed to screenshoot all outputs\n", job->name);
+	grim_disconnect(job->state);
+	job->state = NULL;
+	job->pending = false;
+}
+
+bool capture_displays(char **names, size_t n_names,
+		const struct displays_config *config) {
+	struct display_job *jobs = calloc(n_names, sizeof(struct display_job));
+	struct pollfd *pollfds = calloc(n_names, sizeof(struct pollfd));
+	size_t *pollfd_jobs = calloc(n_names, sizeof(size_t));
+	if (jobs == NULL || pollfds == NULL || pollfd_jobs == NULL) {
+		fprintf(stderr, "failed to allocate displays\n");
+		free(jobs);
+		free(pollfds);
+		free(pollfd_jobs);
+		return false;
+	}
+
+	// Each connection is only waited for once, every capture then runs
+	// at the same time
+	size_t n_pending = 0;
+	for (size_t i = 0; i < n_names; i++) {
+		struct display_job *job = &jobs[i];
+		job->config = config;
+		job->name = names[i];
+		job->path = get_display_path(config->path, job->name);
+		job->state = grim_connect(job->name);
+		if (job->path == NULL || job->state == NULL) {
+			fprintf(stderr, "%s: failed to connect\n", job->name);
+			grim_disconnect(job->state);
+			job->state = NULL;
+			continue;
+		}
+		grim_set_scale_quality(job->state, config->scale_quality);
+		job->pending = grim_capture_start(job->state, NULL,
+			config->with_cursor);
+		if (!job->pending) {
+			fail_display(job);
+			continue;
+		}
+		++n_pending;
+	}
+
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n_threads = n_cpus > 0 ? (size_t)n_cpus : 1;
+	if (n_threads > n_names) {
+		n_threads = n_names;
+	}
+	struct pool *pool = pool_create(n_threads);
+	if (pool == NULL) {
+		fprintf(stderr, "failed to create worker pool\n");
+		n_pending = 0;
+	}
+
+	while (n_pending > 0) {
+		size_t n_pollfds = 0;
+		for (size_t i = 0; i < n_names; i++) {
+			struct display_job *job = &jobs[i];
+			if (!job->pending) {
+				continue;
+			}
+			short events = 0;
+			int fd = grim_prepare_poll(job->state, &events);
+			if (fd < 0) {
+				fail_display(job);
+				--n_pending;
+				continue;
+			}
+			pollfds[n_pollfds] = (struct pollfd){ .fd = fd, .events = events };
+			pollfd_jobs[n_pollfds] = i;
+			++n_pollfds;
+		}
+		if (n_pollfds == 0) {
+			break;
+		}
+
+		bool poll_failed = false;
+		if (poll(pollfds, n_pollfds, -1) < 0) {
+			if (errno != EINTR) {
+				perror("poll");
+				poll_failed = true;
+			}
+			// Reads still have to be cancelled
+			for (size_t i = 0; i < n_pollfds; i++) {
+				pollfds[i].revents = 0;
+			}
+		}
+
+		for (size_t i = 0; i < n_pollfds; i++) {
+			struct display_job *job = &jobs[pollfd_jobs[i]];
+			switch (grim_finish_poll(job->state, pollfds[i].revents)) {
+			case GRIM_CAPTURE_PENDING:
+				break;
+			case GRIM_CAPTURE_DONE:
+				job->pending = false;
+				--n_pending;
+				if (!pool_submit(pool, process_display, job)) {
+					fprintf(stderr, "%s: failed to queue\n", job->name);
+				}
+				break;
+			case GRIM_CAPTURE_FAILED:
+				fail_display(job);
+				--n_pending;
+				break;
+			}
+			if (poll_failed && job->pending) {
+				fail_display(job);
+				--n_pending;
+			}
+		}
+	}
+
+	if (pool != NULL) {
+		pool_finish(pool);
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < n_names; i++) {
+		struct display_job *job = &jobs[i];
+		if (job->state != NULL) {
+			grim_disconnect(job->state);
+		}
+		ok = ok && job->ok;
+		free(job->path);
+	}
+	free(jobs);
+	free(pollfds);
+	free(pollfd_jobs);
+	return ok;
+}
@@ -0,0 +1,123 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "downscale.h"
+
+// A pass sums up to 16x16 pixels: with two 8-bit channels per 32-bit word,
+// each 16-bit lane holds at most 256 * 255 and cannot carry into the next
+#define MAX_PASS_LEVELS 4
+#define CHANNEL_MASK 0x00ff00ffu
+
+int box_downscale_levels(pixman_format_code_t format, double ratio) {
+	// Every channel must be a whole byte for the channel-wise averaging
+	if (PIXMAN_FORMAT_BPP(format) != 32 || PIXMAN_FORMAT_R(format) != 8 ||
+			PIXMAN_FORMAT_G(format) != 8 || PIXMAN_FORMAT_B(format) != 8) {
+		return 0;
+	}
+
+	// Leave a ratio in (0.5, 1] to the final pass, so that it still has
+	// something to interpolate
+	int levels = 0;
+	while (ratio <= 0.5) {
+		ratio *= 2;
+		++levels;
+	}
+	return levels;
+}
+
+// Accumulates one source row into the per-column sums. The loops are kept
+// simple and branch-free so that the compiler can vectorize them.
+static void accumulate_row(uint32_t *restrict lo, uint32_t *restrict hi,
+		const uint32_t *restrict row, int width, int block, int dst_width) {
+	int full = width / block;
+	for (int x = 0; x < full; x++) {
+		const uint32_t *src = row + x * block;
+		uint32_t l = 0, h = 0;
+		for (int i = 0; i < block; i++) {
+			l += src[i] & CHANNEL_MASK;
+			h += (src[i] >> 8) & CHANNEL_MASK;
+		}
+		lo[x] += l;
+		hi[x] += h;
+	}
+	if (full < dst_width) {
+		uint32_t l = 0, h = 0;
+		for (int i = 0; i < block; i++) {
+			int x = full * block + i;
+			uint32_t p = row[x < width ? x : width - 1];
+			l += p & CHANNEL_MASK;
+			h += (p >> 8) & CHANNEL_MASK;
+		}
+		lo[full] += l;
+		hi[full] += h;
+	}
+}
+
+static pixman_image_t *box_downscale_pass(pixman_image_t *image, int levels) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int src_stride = pixman_image_get_stride(image);
+	const unsigned char *src = (unsigned char *)pixman_image_get_data(image);
+
+	int block = 1 << levels;
+	int shift = 2 * levels;
+	uint32_t rounding = (1u << (shift - 1)) * 0x00010001u;
+	int dst_width = (width + block - 1) / block;
+	int dst_height = (height + block - 1) / block;
+
+	pixman_image_t *reduced = pixman_image_create_bits(format,
+		dst_width, dst_height, NULL, 0);
+	uint32_t *sums = calloc(2 * (size_t)dst_width, sizeof(uint32_t));
+	if (reduced == NULL || sums == NULL) {
+		fprintf(stderr, "Failed to allocate downscaled image\n");
+		if (reduced != NULL) {
+			pixman_image_unref(reduced);
+		}
+		free(sums);
+		return NULL;
+	}
+	uint32_t *lo = sums, *hi = sums + dst_width;
+	int dst_stride = pixman_image_get_stride(reduced);
+	unsigned char *dst = (unsigned char *)pixman_image_get_data(reduced);
+
+	for (int y = 0; y < dst_height; y++) {
+		for (int x = 0; x < 2 * dst_width; x++) {
+			sums[x] = 0;
+		}
+		for (int j = 0; j < block; j++) {
+			int src_y = y * block + j;
+			if (src_y >= height) {
+				src_y = height - 1;
+			}
+			const uint32_t *row =
+				(const uint32_t *)(src + (size_t)src_y * src_stride);
+			accumulate_row(lo, hi, row, width, block, dst_width);
+		}
+
+		uint32_t *out = (uint32_t *)(dst + (size_t)y * dst_stride);
+		for (int x = 0; x < dst_width; x++) {
+			out[x] = (((lo[x] + rounding) >> shift) & CHANNEL_MASK) |
+				((((hi[x] + rounding) >> shift) & CHANNEL_MASK) << 8);
+		}
+	}
+
+	free(sums);
+	return reduced;
+}
+
+pixman_image_t *box_downscale(pixman_image_t *image, int levels) {
+	pixman_image_t *reduced = pixman_image_ref(image);
+	while (levels > 0) {
+		int pass_levels = levels < MAX_PASS_LEVELS ? levels : MAX_PASS_LEVELS;
+		pixman_image_t *next = box_downscale_pass(reduced, pass_levels);
+		pixman_image_unref(reduced);
+		if (next == NULL) {
+			return NULL;
+		}
+		reduced = next;
+		levels -= pass_levels;
+	}
+	return reduced;
+}
@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "buffer.h"
+#include "grim.h"
+#include "output-layout.h"
+#include "render.h"
+
+// Each captured output is saved as <index>.raw, holding the frame as the
+// compositor copied it, and <index>.meta, a text file with one "key value"
+// line per field.
+
+static bool write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool dump_output(struct grim_output *output, const char *dir,
+		size_t index) {
+	struct grim_buffer *buffer = output->buffer;
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%zu.raw", dir, index);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	bool ok = write_all(fd, buffer->data, buffer->size);
+	if (!ok) {
+		fprintf(stderr, "failed to write '%s': %s\n", path, strerror(errno));
+	}
+	close(fd);
+	if (!ok) {
+		return false;
+	}
+
+	snprintf(path, sizeof(path), "%s/%zu.meta", dir, index);
+	FILE *f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "failed to open '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	fprintf(f, "format %u\n", (unsigned)buffer->format);
+	fprintf(f, "size %d %d %d\n", buffer->width, buffer->height,
+		buffer->stride);
+	fprintf(f, "geometry %d %d %d %d\n", output->geometry.x,
+		output->geometry.y, output->geometry.width, output->geometry.height);
+	fprintf(f, "transform %d\n", (int)output->transform);
+	fprintf(f, "scale %d\n", output->scale);
+	fprintf(f, "logical_geometry %d %d %d %d\n", output->logical_geometry.x,
+		output->logical_geometry.y, output->logical_geometry.width,
+		output->logical_geometry.height);
+	fprintf(f, "logical_scale %.17g\n", output->logical_scale);
+	fprintf(f, "flags %u\n", output->screencopy_frame_flags);
+	if (output->name != NULL) {
+		fprintf(f, "name %s\n", output->name);
+	}
+	if (fclose(f) != 0) {
+		fprintf(stderr, "failed to write '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool grim_dump(struct grim_state *state, const char *dir) {
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "failed to create '%s': %s\n", dir, strerror(errno));
+		return false;
+	}
+
+	size_t index = 0;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer == NULL) {
+			continue;
+		}
+		if (!dump_output(output, dir, index)) {
+			return false;
+		}
+		index++;
+	}
+	if (index == 0) {
+		fprintf(stderr, "nothing captured to dump\n");
+		return false;
+	}
+	return true;
+}
+
+static bool parse_meta(FILE *f, struct grim_output *output,
+		uint32_t *format, int32_t *width, int32_t *height, int32_t *stride) {
+	struct grim_box *g = &output->geometry;
+	struct grim_box *l = &output->logical_geometry;
+	unsigned fields = 0;
+	bool valid_transform = true;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t nread;
+	while ((nread = getline(&line, &line_size, f)) != -1) {
+		if (nread > 0 && line[nread - 1] == '\n') {
+			line[nread - 1] = '\0';
+		}
+
+		int transform;
+		if (sscanf(line, "format %u", format) == 1) {
+			fields |= 1 << 0;
+		} else if (sscanf(line, "size %d %d %d", width, height,
+				stride) == 3) {
+			fields |= 1 << 1;
+		} else if (sscanf(line, "geometry %d %d %d %d",
+				&g->x, &g->y, &g->width, &g->height) == 4) {
+			fields |= 1 << 2;
+		} else if (sscanf(line, "transform %d", &transform) == 1) {
+			valid_transform = transform >= WL_OUTPUT_TRANSFORM_NORMAL &&
+				transform <= WL_OUTPUT_TRANSFORM_FLIPPED_270;
+			output->transform = transform;
+		} else if (sscanf(line, "scale %d", &output->scale) == 1) {
+			// optional
+		} else if (sscanf(line, "logical_geometry %d %d %d %d",
+				&l->x, &l->y, &l->width, &l->height) == 4) {
+			fields |= 1 << 3;
+		} else if (sscanf(line, "logical_scale %lf",
+				&output->logical_scale) == 1) {
+			// optional
+		} else if (sscanf(line, "flags %u",
+				&output->screencopy_frame_flags) == 1) {
+			// optional
+		} else if (strncmp(line, "name ", strlen("name ")) == 0) {
+			free(output->name);
+			output->name = strdup(line + strlen("name "));
+		}
+	}
+	free(line);
+	// Rejected the same way as a bad size, rendering relies on these
+	return fields == 0xf && valid_transform && output->scale > 0 &&
+		output->logical_scale > 0 && g->width > 0 && g->height > 0 &&
+		l->width > 0 && l->height > 0;
+}
+
+// Returns 1 if the output was loaded, 0 if there is no such output, -1 on
+// error
+static int load_output(struct grim_state *state, const char *dir,
+		size_t index) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%zu.meta", dir, index);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+		fprintf(stderr, "failed to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	struct grim_output *output = calloc(1, sizeof(struct grim_output));
+	if (output == NULL) {
+		fprintf(stderr, "failed to allocate output\n");
+		fclose(f);
+		return -1;
+	}
+	output->state = state;
+	output->scale = 1;
+	output->logical_scale = 1;
+	wl_list_insert(state->outputs.prev, &output->link);
+
+	uint32_t format = 0;
+	int32_t width = 0, height = 0, stride = 0;
+	bool ok = parse_meta(f, output, &format, &width, &height, &stride);
+	fclose(f);
+	if (!ok || width <= 0 || height <= 0 || stride <= 0) {
+		fprintf(stderr, "invalid output description in '%s'\n", path);
+		return -1;
+	}
+	pixman_format_code_t pixman_fmt = get_pixman_format(format);
+	if (pixman_fmt == 0) {
+		fprintf(stderr, "unsupported format %u in '%s'\n", format, path);
+		return -1;
+	}
+	if ((int64_t)stride * 8 < (int64_t)width * PIXMAN_FORMAT_BPP(pixman_fmt)) {
+		fprintf(stderr, "stride %d is too small for a %d pixels wide frame "
+			"in '%s'\n", stride, width, path);
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/%zu.raw", dir, index);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "failed to open '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 ||
+			(uint64_t)stride * height > (uint64_t)st.st_size ||
+			(uint64_t)stride * height > SIZE_MAX) {
+		fprintf(stderr, "'%s' is too small for a %dx%d frame\n", path,
+			width, height);
+		close(fd);
+		return -1;
+	}
+	output->buffer = load_buffer(fd, format, width, height, stride);
+	close(fd);
+	if (output->buffer == NULL) {
+		fprintf(stderr, "failed to map '%s'\n", path);
+		return -1;
+	}
+	return 1;
+}
+
+struct grim_state *grim_load_dump(const char *dir) {
+	struct grim_state *state = calloc(1, sizeof(struct grim_state));
+	if (state == NULL) {
+		fprintf(stderr, "failed to allocate state\n");
+		return NULL;
+	}
+	wl_list_init(&state->outputs);
+
+	// Outputs are numbered from 0, the first missing one ends the dump
+	int ret;
+	for (size_t i = 0; (ret = load_output(state, dir, i)) > 0; i++) {
+		// keep going
+	}
+	if (ret < 0) {
+		grim_disconnect(state);
+		return NULL;
+	}
+	if (wl_list_empty(&state->outputs)) {
+		fprintf(stderr, "no output found in dump '%s'\n", dir);
+		grim_disconnect(state);
+		return NULL;
+	}
+
+	// Logical geometries are restored as they were, not guessed again
+	build_output_layout(state);
+	state->layout_ready = true;
+	return state;
+}
@@ -0,0 +1,275 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "band.h"
+#include "libgrim.h"
+#include "sink.h"
+#include "write_ppm.h"
+#include "writer.h"
+
+// Writers linking against big libraries are modules, loaded on first use
+// only, so that e.g. writing a PPM doesn't pay for loading libpng
+static const char *const writer_modules[] = {
+	[GRIM_FILETYPE_PNG] = "grim-png",
+	[GRIM_FILETYPE_JPEG] = "grim-jpeg",
+	[GRIM_FILETYPE_WEBP] = "grim-webp",
+};
+
+static pthread_mutex_t writers_lock = PTHREAD_MUTEX_INITIALIZER;
+static const struct grim_writer *writers[GRIM_FILETYPE_WEBP + 1];
+
+struct module_dir {
+	const char *path;
+	size_t len;
+};
+
+// Errors aren't printed if quiet, when only probing for the module
+static const struct grim_writer *load_writer(enum grim_filetype filetype,
+		bool quiet) {
+	const char *module = writer_modules[filetype];
+
+	// GRIM_MODULE_DIR if set, then the install directory, then the
+	// directory of libgrim itself, which is where the modules are in a
+	// build tree
+	struct module_dir dirs[3];
+	size_t n_dirs = 0;
+	const char *env_dir = getenv("GRIM_MODULE_DIR");
+	if (env_dir != NULL && env_dir[0] != '\0') {
+		dirs[n_dirs++] = (struct module_dir){ env_dir, strlen(env_dir) };
+	}
+	dirs[n_dirs++] = (struct module_dir){
+		GRIM_MODULE_DIR, strlen(GRIM_MODULE_DIR) };
+	Dl_info info;
+	const char *slash;
+	if (dladdr(&writers_lock, &info) != 0 && info.dli_fname != NULL &&
+			(slash = strrchr(info.dli_fname, '/')) != NULL) {
+		dirs[n_dirs++] = (struct module_dir){
+			info.dli_fname, slash - info.dli_fname };
+	}
+
+	char path[4096];
+	void *handle = NULL;
+	// The first error is the most relevant one, later dlopen() calls
+	// overwrite it
+	char error[512] = "not found";
+	bool has_error = false;
+	for (size_t i = 0; i < n_dirs && handle == NULL; i++) {
+		if (snprintf(path, sizeof(path), "%.*s/%s.so", (int)dirs[i].len,
+				dirs[i].path, module) >= (int)sizeof(path)) {
+			continue;
+		}
+		// Never closed, the module stays around until exit
+		handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+		if (handle == NULL && !has_error) {
+			snprintf(error, sizeof(error), "%s", dlerror());
+			has_error = true;
+		}
+	}
+	if (handle == NULL) {
+		if (!quiet) {
+			fprintf(stderr, "failed to load writer module %s: %s\n"
+				"check that grim is installed correctly, or set "
+				"GRIM_MODULE_DIR\n", module, error);
+		}
+		return NULL;
+	}
+
+	const struct grim_writer *writer = dlsym(handle, "grim_writer");
+	if (writer == NULL) {
+		if (!quiet) {
+			fprintf(stderr, "%s is not a grim writer module\n", path);
+		}
+		dlclose(handle);
+		return NULL;
+	}
+	if (writer->version != GRIM_WRITER_VERSION) {
+		if (!quiet) {
+			fprintf(stderr, "writer module %s has version %d, expected %d\n",
+				path, writer->version, GRIM_WRITER_VERSION);
+		}
+		dlclose(handle);
+		return NULL;
+	}
+	return writer;
+}
+
+static const struct grim_writer *find_writer(enum grim_filetype filetype,
+		bool quiet) {
+	pthread_mutex_lock(&writers_lock);
+	if (writers[filetype] == NULL) {
+		writers[filetype] = load_writer(filetype, quiet);
+	}
+	const struct grim_writer *writer = writers[filetype];
+	pthread_mutex_unlock(&writers_lock);
+	return writer;
+}
+
+const struct grim_writer *get_writer(enum grim_filetype filetype) {
+	return find_writer(filetype, false);
+}
+
+void grim_init_encode_options(struct grim_encode_options *options,
+		enum grim_filetype filetype) {
+	*options = (struct grim_encode_options){
+		.filetype = filetype,
+		.quality = filetype == GRIM_FILETYPE_WEBP ? -1 : 80,
+		.level = 6, // current default png/zlib compression level
+	};
+}
+
+bool grim_filetype_supported(enum grim_filetype filetype) {
+	switch (filetype) {
+	case GRIM_FILETYPE_PNG:
+	case GRIM_FILETYPE_PPM:
+		return true;
+	case GRIM_FILETYPE_JPEG:
+#ifdef HAVE_JPEG
+		return true;
+#else
+		return false;
+#endif
+	case GRIM_FILETYPE_WEBP:
+#ifdef HAVE_WEBP
+		return true;
+#else
+		return false;
+#endif
+	}
+	return false;
+}
+
+bool grim_filetype_available(enum grim_filetype filetype) {
+	if (!grim_filetype_supported(filetype)) {
+		return false;
+	}
+	return filetype == GRIM_FILETYPE_PPM || find_writer(filetype, true) != NULL;
+}
+
+int grim_encode(pixman_image_t *image,
+		const struct grim_encode_options *options, grim_write_func write,
+		void *data) {
+	if (!grim_filetype_supported(options->filetype)) {
+		fprintf(stderr, "filetype %d support disabled\n", options->filetype);
+		return -1;
+	}
+
+	struct grim_sink sink = { .write = write, .data = data };
+	if (options->filetype == GRIM_FILETYPE_PPM) {
+		if (options->deadline_ms > 0) {
+			fprintf(stderr, "deadline: nothing to tune for ppm\n");
+		}
+		return write_to_ppm_sink(image, &sink);
+	}
+
+	const struct grim_writer *writer = get_writer(options->filetype);
+	if (writer == NULL) {
+		return -1;
+	}
+	return writer->encode(image, &sink, options);
+}
+
+int grim_render_encode(struct grim_state *state, const struct grim_box *box,
+		double scale, size_t budget, const struct grim_encode_options *options,
+		grim_write_func write, void *data) {
+	if (!grim_render_needs_bands(box, scale, budget)) {
+		pixman_image_t *image = grim_render(state, box, scale);
+		if (image == NULL) {
+			return -1;
+		}
+		int ret = grim_encode(image, options, write, data);
+		pixman_image_unref(image);
+		return ret;
+	}
+
+	if (!grim_filetype_supported(options->filetype)) {
+		fprintf(stderr, "filetype %d support disabled\n", options->filetype);
+		return -1;
+	}
+
+	struct grim_band_source source;
+	if (!init_band_source(&source, state, box, scale, budget)) {
+		return -1;
+	}
+	if (options->deadline_ms > 0) {
+		fprintf(stderr, "deadline: ignored for images encoded in bands\n");
+	}
+
+	struct grim_sink sink = { .write = write, .data = data };
+	if (options->filetype == GRIM_FILETYPE_PPM) {
+		return write_bands_to_ppm_sink(&source, &sink);
+	}
+
+	const struct grim_writer *writer = get_writer(options->filetype);
+	if (writer == NULL) {
+		return -1;
+	}
+	if (writer->encode_bands == NULL) {
+		fprintf(stderr, "image is too large to be encoded as %s\n",
+			writer->name);
+		return -1;
+	}
+	return writer->encode_bands(&source, &sink, options);
+}
+
+struct grim_animation {
+	const struct grim_writer *writer;
+	struct grim_sink sink;
+	void *data;
+};
+
+struct grim_animation *grim_animation_begin(
+		const struct grim_encode_options *options, uint32_t n_frames,
+		grim_write_func write, void *data) {
+	if (!grim_filetype_supported(options->filetype)) {
+		fprintf(stderr, "filetype %d support disabled\n", options->filetype);
+		return NULL;
+	}
+	if (n_frames == 0) {
+		fprintf(stderr, "an animation needs at least one frame\n");
+		return NULL;
+	}
+
+	const struct grim_writer *writer = NULL;
+	if (options->filetype != GRIM_FILETYPE_PPM) {
+		writer = get_writer(options->filetype);
+		if (writer == NULL) {
+			return NULL;
+		}
+	}
+	if (writer == NULL || writer->animation_begin == NULL) {
+		fprintf(stderr, "filetype %d doesn't support animations\n",
+			options->filetype);
+		return NULL;
+	}
+
+	struct grim_animation *animation = calloc(1, sizeof(*animation));
+	if (animation == NULL) {
+		fprintf(stderr, "failed to allocate animation\n");
+		return NULL;
+	}
+	animation->writer = writer;
+	animation->sink = (struct grim_sink){ .write = write, .data = data };
+	animation->data = writer->animation_begin(&animation->sink, options,
+		n_frames);
+	if (animation->data == NULL) {
+		free(animation);
+		return NULL;
+	}
+	return animation;
+}
+
+int grim_animation_add_frame(struct grim_animation *animation,
+		pixman_image_t *image, uint32_t delay_ms) {
+	return animation->writer->animation_add_frame(animation->data, image,
+		delay_ms);
+}
+
+int grim_animation_end(struct grim_animation *animation) {
+	int ret = animation->writer->animation_end(animation->data);
+	free(animation);
+	return ret;
+}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pixman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+static int connect_target(const char *target, bool *owned) {
+	char *end = NULL;
+	errno = 0;
+	long fd = strtol(target, &end, 10);
+	if (target[0] != '\0' && *end == '\0' && errno == 0) {
+		// An inherited, already connected socket
+		*owned = false;
+		return fd;
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(target) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path '%s' is too long\n", target);
+		return -1;
+	}
+	strcpy(addr.sun_path, target);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "failed to connect to '%s': %s\n", target,
+			strerror(errno));
+		close(sock);
+		return -1;
+	}
+	*owned = true;
+	return sock;
+}
+
+static bool send_image_fd(int sock, int fd, const void *msg, size_t len) {
+	struct iovec iov = {
+		.iov_base = (void *)msg,
+		.iov_len = len,
+	};
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msghdr = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msghdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ssize_t n;
+	do {
+		n = sendmsg(sock, &msghdr, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		perror("sendmsg");
+		return false;
+	}
+
+	// The fd went out with the first byte, the rest is plain data
+	const char *data = msg;
+	size_t written = n;
+	while (written < len) {
+		n = send(sock, data + written, len - written, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			perror("send");
+			return false;
+		}
+		written += n;
+	}
+	return true;
+}
+
+bool handoff_image(struct grim_state *state, struct grim_box *geometry,
+		double scale, const char *target) {
+	// The whole image goes in one memfd
+	if (grim_render_needs_bands(geometry, scale, 0)) {
+		fprintf(stderr, "image is too large to be handed off\n");
+		return false;
+	}
+
+	int width = geometry->width * scale;
+	int height = geometry->height * scale;
+	int stride = width * 4;
+	size_t size = (size_t)stride * height;
+
+	size_t n_outputs = 0;
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer != NULL) {
+			++n_outputs;
+		}
+	}
+
+	size_t msg_len = sizeof(struct grim_handoff_header) +
+		n_outputs * sizeof(struct grim_handoff_output);
+	struct grim_handoff_header *header = calloc(1, msg_len);
+	if (header == NULL) {
+		fprintf(stderr, "failed to allocate handoff header\n");
+		return false;
+	}
+	header->magic = GRIM_HANDOFF_MAGIC;
+	header->version = GRIM_HANDOFF_VERSION;
+	header->size = size;
+	header->width = width;
+	header->height = height;
+	header->stride = stride;
+	header->format = PIXMAN_a8r8g8b8;
+	header->n_outputs = n_outputs;
+
+	struct grim_handoff_output *handoff_outputs =
+		(struct grim_handoff_output *)(header + 1);
+	size_t i = 0;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->buffer == NULL) {
+			continue;
+		}
+		struct grim_handoff_output *out = &handoff_outputs[i++];
+		out->x = round((output->logical_geometry.x - geometry->x) * scale);
+		out->y = round((output->logical_geometry.y - geometry->y) * scale);
+		out->width = round(output->logical_geometry.width * scale);
+		out->height = round(output->logical_geometry.height * scale);
+		if (output->name != NULL) {
+			snprintf(out->name, sizeof(out->name), "%s", output->name);
+		}
+	}
+
+	bool ok = false;
+	int sock = -1;
+	bool sock_owned = false;
+	void *data = MAP_FAILED;
+	pixman_image_t *image = NULL;
+
+	int fd = memfd_create("grim", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		perror("memfd_create");
+		goto out;
+	}
+	if (ftruncate(fd, size) < 0) {
+		perror("ftruncate");
+		goto out;
+	}
+
+	// Composite straight into the memfd, there is no other copy
+	data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		goto out;
+	}
+	image = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
+		data, stride);
+	if (image == NULL) {
+		fprintf(stderr, "Failed to create image\n");
+		goto out;
+	}
+	if (!grim_render_to_image(state, geometry, scale, image)) {
+		goto out;
+	}
+	pixman_image_unref(image);
+	image = NULL;
+	munmap(data, size);
+	data = MAP_FAILED;
+
+	// Writable mappings are gone, so the consumer can rely on the contents
+	// never changing under its feet
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+			F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+		perror("fcntl(F_ADD_SEALS)");
+		goto out;
+	}
+
+	sock = connect_target(target, &sock_owned);
+	if (sock < 0) {
+		goto out;
+	}
+	ok = send_image_fd(sock, fd, header, msg_len);
+
+out:
+	if (sock >= 0 && sock_owned) {
+		close(sock);
+	}
+	if (image != NULL) {
+		pixman_image_unref(image);
+	}
+	if (data != MAP_FAILED) {
+		munmap(data, size);
+	}
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(header);
+	return ok;
+}
@@ -0,0 +1,148 @@
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+// Reads are little-endian, so that digests don't depend on the machine
+static inline uint64_t read64(const uint8_t *p) {
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--) {
+		v = (v << 8) | p[i];
+	}
+	return v;
+}
+
+static inline uint32_t read32(const uint8_t *p) {
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+		(uint32_t)p[3] << 24;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+	acc += input * PRIME2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+	acc ^= round64(0, val);
+	return acc * PRIME1 + PRIME4;
+}
+
+void hash_init(struct grim_hash *hash, uint64_t seed) {
+	*hash = (struct grim_hash){
+		.acc = {
+			seed + PRIME1 + PRIME2,
+			seed + PRIME2,
+			seed,
+			seed - PRIME1,
+		},
+		.seed = seed,
+	};
+}
+
+// The four lanes are independent, which lets the compiler interleave them
+static const uint8_t *consume_stripes(uint64_t acc[static 4],
+		const uint8_t *p, const uint8_t *end) {
+	uint64_t a0 = acc[0], a1 = acc[1], a2 = acc[2], a3 = acc[3];
+	while (end - p >= 32) {
+		a0 = round64(a0, read64(p));
+		a1 = round64(a1, read64(p + 8));
+		a2 = round64(a2, read64(p + 16));
+		a3 = round64(a3, read64(p + 24));
+		p += 32;
+	}
+	acc[0] = a0;
+	acc[1] = a1;
+	acc[2] = a2;
+	acc[3] = a3;
+	return p;
+}
+
+void hash_update(struct grim_hash *hash, const void *data, size_t len) {
+	const uint8_t *p = data;
+	const uint8_t *end = p + len;
+	hash->total_len += len;
+
+	if (hash->buf_len > 0) {
+		size_t n = sizeof(hash->buf) - hash->buf_len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(hash->buf + hash->buf_len, p, n);
+		hash->buf_len += n;
+		p += n;
+		if (hash->buf_len < sizeof(hash->buf)) {
+			return;
+		}
+		consume_stripes(hash->acc, hash->buf, hash->buf + sizeof(hash->buf));
+		hash->buf_len = 0;
+	}
+
+	p = consume_stripes(hash->acc, p, end);
+	memcpy(hash->buf, p, end - p);
+	hash->buf_len = end - p;
+}
+
+uint64_t hash_digest(const struct grim_hash *hash) {
+	uint64_t h;
+	if (hash->total_len >= 32) {
+		const uint64_t *acc = hash->acc;
+		h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) +
+			rotl64(acc[3], 18);
+		for (int i = 0; i < 4; i++) {
+			h = merge_round(h, acc[i]);
+		}
+	} else {
+		h = hash->seed + PRIME5;
+	}
+	h += hash->total_len;
+
+	const uint8_t *p = hash->buf;
+	const uint8_t *end = p + hash->buf_len;
+	while (end - p >= 8) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * PRIME1 + PRIME4;
+		p += 8;
+	}
+	if (end - p >= 4) {
+		h ^= (uint64_t)read32(p) * PRIME1;
+		h = rotl64(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	while (p < end) {
+		h ^= *p * PRIME5;
+		h = rotl64(h, 11) * PRIME1;
+		p++;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+uint64_t hash_image(pixman_image_t *image) {
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	const uint8_t *data = (const uint8_t *)pixman_image_get_data(image);
+
+	// Two images of the same pixels but different sizes must differ
+	struct grim_hash hash;
+	hash_init(&hash, (uint64_t)width << 32 | (uint32_t)height);
+	for (int y = 0; y < height; y++) {
+		hash_update(&hash, data + (size_t)y * stride, (size_t)width * 4);
+	}
+	return hash_digest(&hash);
+}
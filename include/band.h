@@ -0,0 +1,32 @@
+#ifndef _BAND_H
+#define _BAND_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "grim.h"
+
+// An image too large to be held in memory at once, rendered a band of rows
+// at a time. Rows are a8r8g8b8, like the images of grim_render().
+struct grim_band_source {
+	struct grim_state *state;
+	struct grim_box geometry;
+	double scale;
+	int32_t width, height;
+	int32_t band_height;
+};
+
+// Returns 0 on success, -1 on error
+typedef int (*band_row_func)(void *data, const uint32_t *row, int32_t y);
+
+bool init_band_source(struct grim_band_source *source,
+	struct grim_state *state, const struct grim_box *geometry, double scale,
+	size_t budget);
+// Renders the bands in order and calls func on each row of the image.
+// Returns 0 on success, -1 on error. Not part of the API, but exported for
+// the writer modules.
+GRIM_EXPORT int grim_for_each_band_row(const struct grim_band_source *source,
+	band_row_func func, void *data);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "libgrim.h"
+
+struct bench_options {
+	const struct grim_box *geometry;
+	double scale;
+	bool with_cursor;
+	const struct grim_encode_options *encode_options;
+	uint32_t n_runs;
+};
+
+/**
+ * Repeats the whole capture, render and encode cycle with the same
+ * connection, discarding the images, and prints the latency percentiles of
+ * each phase, the frame rate and the allocations made along the way.
+ */
+bool run_bench(struct grim_state *state, const struct bench_options *options);
+
+#endif
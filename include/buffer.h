@@ -1,6 +1,8 @@
 #ifndef _BUFFER_H
 #define _BUFFER_H
 
+#include <stdint.h>
+#include <sys/types.h>
 #include <wayland-client.h>
 
 struct grim_buffer {
@@ -8,11 +10,28 @@ struct grim_buffer {
 	void *data;
 	int32_t width, height, stride;
 	size_t size;
+	size_t map_offset; // of data from the start of the mapping
 	enum wl_shm_format format;
 };
 
 struct grim_buffer *create_buffer(struct wl_shm *shm, enum wl_shm_format format,
 	int32_t width, int32_t height, int32_t stride);
+// Uses stride * height bytes of the file from offset. The file descriptor
+// isn't consumed.
+struct grim_buffer *create_buffer_from_fd(struct wl_shm *shm, int fd,
+	off_t offset, enum wl_shm_format format, int32_t width, int32_t height,
+	int32_t stride);
+// Maps a buffer saved to a file, without a wl_buffer
+struct grim_buffer *load_buffer(int fd, enum wl_shm_format format,
+	int32_t width, int32_t height, int32_t stride);
+struct grim_state;
+struct grim_output;
+
+// Reuses *spare, which is taken, when it has the right size, unless the
+// caller provides the memory. Frames of toplevels always use grim's own.
+struct grim_buffer *get_frame_buffer(struct grim_state *state,
+	struct grim_output *output, struct grim_buffer **spare,
+	uint32_t format, uint32_t width, uint32_t height, uint32_t stride);
 void destroy_buffer(struct grim_buffer *buffer);
 
 #endif
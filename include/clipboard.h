@@ -0,0 +1,22 @@
+#ifndef _CLIPBOARD_H
+#define _CLIPBOARD_H
+
+#include <pixman.h>
+#include <stdbool.h>
+
+#include "libgrim.h"
+
+struct grim_clipboard;
+
+/**
+ * Takes the selection of the first seat with the image, encoded with the
+ * given options, and offered in the other supported filetypes too. Returns
+ * NULL on error.
+ */
+struct grim_clipboard *clipboard_offer(const char *display_name,
+	pixman_image_t *image, const struct grim_encode_options *options);
+// Sends the image to pasting clients until the selection is replaced
+bool clipboard_serve(struct grim_clipboard *clipboard);
+void clipboard_destroy(struct grim_clipboard *clipboard);
+
+#endif
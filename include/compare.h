@@ -0,0 +1,31 @@
+#ifndef _COMPARE_H
+#define _COMPARE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "libgrim.h"
+
+struct compare_options {
+	int tolerance; // largest difference of a channel still considered equal
+	const struct grim_box *masks; // ignored regions, in image pixels
+	size_t n_masks;
+};
+
+struct compare_result {
+	uint64_t n_changed;
+	struct grim_box bounds; // of the changed pixels
+};
+
+/**
+ * Compares an a8r8g8b8 image with a reference of the same size. The alpha
+ * channel is ignored if the reference has none. If diff isn't NULL, changed
+ * pixels are painted red onto it, and the others are copied dimmed.
+ */
+void compare_images(pixman_image_t *image, pixman_image_t *ref,
+	const struct compare_options *options, pixman_image_t *diff,
+	struct compare_result *result);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _COPY_CAPTURE_H
+#define _COPY_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client.h>
+
+#include "grim.h"
+
+// An ext-image-copy-capture-v1 session of an output or a toplevel. The
+// session is kept across captures, so that later ones don't wait for the
+// buffer constraints.
+struct grim_copy_capture {
+	struct grim_state *state;
+	struct grim_output *output; // NULL for a toplevel
+	const char *name; // of the toplevel, for messages
+	struct ext_image_capture_source_v1 *source;
+	struct ext_image_copy_capture_session_v1 *session;
+	struct ext_image_copy_capture_frame_v1 *frame;
+	bool with_cursor;
+	bool stopped;
+
+	// Buffer constraints, usable once done
+	uint32_t width, height;
+	uint32_t shm_format;
+	bool has_shm_format;
+	bool constraints_done;
+
+	bool frame_wanted; // waiting for the constraints
+	int retries; // after the constraints changed under a frame
+	enum wl_output_transform transform; // of the last frame
+
+	// Where the frame goes, and the previous one to reuse
+	struct grim_buffer **buffer, **spare_buffer;
+};
+
+// Whether outputs are captured with ext-image-copy-capture-v1 rather than
+// wlr-screencopy-unstable-v1
+bool can_copy_capture_outputs(struct grim_state *state);
+// Takes the source. Frames count in state->n_done once ready.
+struct grim_copy_capture *create_copy_capture(struct grim_state *state,
+	struct grim_output *output, const char *name,
+	struct ext_image_capture_source_v1 *source, struct grim_buffer **buffer,
+	struct grim_buffer **spare_buffer);
+void destroy_copy_capture(struct grim_copy_capture *capture);
+void copy_capture_start(struct grim_copy_capture *capture, bool with_cursor);
+// Drops the frame in flight, if any
+void copy_capture_cancel(struct grim_copy_capture *capture);
+
+#endif
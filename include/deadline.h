@@ -0,0 +1,25 @@
+#ifndef _DEADLINE_H
+#define _DEADLINE_H
+
+#include <pixman.h>
+#include <stddef.h>
+
+#include "sink.h"
+
+// Full-image estimates extrapolated from a trial on the sample
+struct trial_result {
+	double time_ms;
+	double size;
+};
+
+typedef int (*encode_func)(pixman_image_t *image, struct grim_sink *sink,
+	const void *params);
+
+// Candidates are sorted from the fastest to the slowest. Returns the index
+// of the one giving the smallest output while fitting in the deadline,
+// falling back to the fastest one.
+size_t choose_candidate(pixman_image_t *image, long deadline_ms,
+	encode_func encode, const void *candidates, size_t params_size,
+	size_t n_candidates, struct trial_result *chosen_result);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef _DISPLAYS_H
+#define _DISPLAYS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "libgrim.h"
+#include "output-file.h"
+
+struct displays_config {
+	const struct grim_box *geometry; // NULL for the whole layout
+	const char *output_name; // or NULL
+	double scale; // 0 for the greatest output scale
+	bool with_cursor;
+	enum grim_scale_quality scale_quality;
+	struct grim_encode_options encode_options;
+	struct output_file_options file_options;
+	// The image of each display is written next to it, prefixed with the
+	// display name
+	const char *path;
+};
+
+// Captures all displays at once, and encodes their images in parallel
+bool capture_displays(char **names, size_t n_names,
+	const struct displays_config *config);
+
+#endif
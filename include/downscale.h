@@ -0,0 +1,14 @@
+#ifndef _DOWNSCALE_H
+#define _DOWNSCALE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+
+// Number of 2x box reductions worth doing before the final filter pass for
+// the given ratio, 0 if the ratio or the format don't allow any
+int box_downscale_levels(pixman_format_code_t format, double ratio);
+// Shrinks the image by 2^levels in both directions, averaging each block of
+// pixels. Edge blocks are padded by repeating the last row and column.
+pixman_image_t *box_downscale(pixman_image_t *image, int levels);
+
+#endif
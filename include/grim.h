@@ -1,16 +1,24 @@
 #ifndef _GRIM_H
 #define _GRIM_H
 
+#include <stdbool.h>
 #include <wayland-client.h>
 
 #include "box.h"
+#include "ext-foreign-toplevel-list-v1-client-protocol.h"
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+#include "libgrim.h"
 #include "wlr-screencopy-unstable-v1-client-protocol.h"
 #include "xdg-output-unstable-v1-client-protocol.h"
 
-enum grim_filetype {
-	GRIM_FILETYPE_PNG,
-	GRIM_FILETYPE_PPM,
-	GRIM_FILETYPE_JPEG,
+struct grim_output;
+
+// Index over the output layout, built once all outputs are known
+struct grim_output_layout {
+	struct grim_output **outputs; // sorted by logical x
+	size_t n_outputs;
+	struct grim_box extents;
 };
 
 struct grim_state {
@@ -19,16 +27,32 @@ struct grim_state {
 	struct wl_shm *shm;
 	struct zxdg_output_manager_v1 *xdg_output_manager;
 	struct zwlr_screencopy_manager_v1 *screencopy_manager;
+	// ext-image-copy-capture-v1, preferred over screencopy when available
+	struct ext_image_copy_capture_manager_v1 *copy_capture_manager;
+	struct ext_output_image_capture_source_manager_v1 *output_source_manager;
+	struct ext_foreign_toplevel_image_capture_source_manager_v1 *toplevel_source_manager;
+	// Bound only to capture a toplevel, the list sends all of them
+	uint32_t toplevel_list_name;
 	struct wl_list outputs;
+	struct grim_output_layout layout;
+	bool layout_ready;
+	enum grim_scale_quality scale_quality;
+
+	grim_buffer_func buffer_func;
+	void *buffer_func_data;
+	size_t n_buffers_created;
 
-	size_t n_done;
+	size_t n_pending, n_done;
+	bool capture_failed;
 };
 
 struct grim_buffer;
+struct grim_copy_capture;
 
 struct grim_output {
 	struct grim_state *state;
 	struct wl_output *wl_output;
+	uint32_t global_name;
 	struct zxdg_output_v1 *xdg_output;
 	struct wl_list link;
 
@@ -39,10 +63,14 @@ struct grim_output {
 	struct grim_box logical_geometry;
 	double logical_scale; // guessed from the logical size
 	char *name;
+	bool wl_output_done, xdg_output_done;
+	bool overlapping; // with another output, set in the layout index
 
 	struct grim_buffer *buffer;
+	struct grim_buffer *spare_buffer; // from the previous capture, for reuse
 	struct zwlr_screencopy_frame_v1 *screencopy_frame;
 	uint32_t screencopy_frame_flags; // enum zwlr_screencopy_frame_v1_flags
+	struct grim_copy_capture *copy_capture; // kept across captures
 };
 
 #endif
@@ -0,0 +1,36 @@
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "grim.h"
+
+#define GRIM_HANDOFF_MAGIC 0x6d697267 // "grim" in little-endian
+#define GRIM_HANDOFF_VERSION 1
+#define GRIM_HANDOFF_NAME_SIZE 64
+
+// Message sent along with the memfd. The memfd holds height rows of stride
+// bytes each, in the given pixman format, starting at offset 0. The header
+// is followed by n_outputs output descriptions.
+struct grim_handoff_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;
+	uint32_t width, height, stride;
+	uint32_t format; // pixman_format_code_t
+	uint32_t n_outputs;
+	uint32_t reserved;
+};
+
+// Where an output landed in the image, in pixels
+struct grim_handoff_output {
+	int32_t x, y;
+	int32_t width, height;
+	char name[GRIM_HANDOFF_NAME_SIZE];
+};
+
+bool handoff_image(struct grim_state *state, struct grim_box *geometry,
+	double scale, const char *target);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <pixman.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming XXH64, fast enough to hash whole screenshots in a fraction of
+// the time it takes to encode them
+struct grim_hash {
+	uint64_t acc[4];
+	uint8_t buf[32];
+	size_t buf_len;
+	uint64_t total_len;
+	uint64_t seed;
+};
+
+void hash_init(struct grim_hash *hash, uint64_t seed);
+void hash_update(struct grim_hash *hash, const void *data, size_t len);
+uint64_t hash_digest(const struct grim_hash *hash);
+
+// Hashes the pixels and size of an a8r8g8b8 or x8r8g8b8 image, ignoring the
+// row padding
+uint64_t hash_image(pixman_image_t *image);
+
+#endif
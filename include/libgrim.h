@@ -0,0 +1,238 @@
+#ifndef _LIBGRIM_H
+#define _LIBGRIM_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * libgrim grabs images from a Wayland compositor supporting
+ * ext-image-copy-capture-v1 or wlr-screencopy-unstable-v1, in the same way
+ * as the grim executable.
+ *
+ * A connection is set up once with grim_connect() and can then be used for
+ * any number of captures. Errors are reported on the standard error, and
+ * signalled through the return value.
+ */
+
+// libgrim is built with hidden symbols, only these functions are exported
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define GRIM_EXPORT __attribute__((visibility("default")))
+#else
+#define GRIM_EXPORT
+#endif
+
+struct grim_state;
+struct grim_output;
+
+struct grim_box {
+	int32_t x, y;
+	int32_t width, height;
+};
+
+enum grim_filetype {
+	GRIM_FILETYPE_PNG,
+	GRIM_FILETYPE_PPM,
+	GRIM_FILETYPE_JPEG,
+	GRIM_FILETYPE_WEBP,
+};
+
+// How outputs are filtered when downscaled by more than half
+enum grim_scale_quality {
+	GRIM_SCALE_QUALITY_GOOD, // box reductions, then Lanczos
+	GRIM_SCALE_QUALITY_FAST, // box reductions, then bilinear
+	GRIM_SCALE_QUALITY_BEST, // Lanczos over the full-size output
+};
+
+/**
+ * Connects to the given Wayland display (NULL for the default one) and
+ * enumerates its outputs. Returns NULL on error.
+ *
+ * The output layout isn't waited for here: it is requested along with the
+ * first capture, and the functions below needing it wait for it.
+ */
+GRIM_EXPORT struct grim_state *grim_connect(const char *display_name);
+GRIM_EXPORT void grim_disconnect(struct grim_state *state);
+
+// Waits for the output layout. Returns false on error.
+GRIM_EXPORT bool grim_wait_for_layout(struct grim_state *state);
+// Outputs are sorted by logical x position. An output is freed when the
+// compositor removes it, which is only noticed while waiting for events.
+GRIM_EXPORT size_t grim_get_output_count(struct grim_state *state);
+GRIM_EXPORT struct grim_output *grim_get_output(struct grim_state *state,
+	size_t index);
+GRIM_EXPORT struct grim_output *grim_find_output(struct grim_state *state,
+	const char *name);
+GRIM_EXPORT const char *grim_output_get_name(struct grim_output *output);
+GRIM_EXPORT void grim_output_get_logical_geometry(struct grim_output *output,
+	struct grim_box *box);
+GRIM_EXPORT double grim_output_get_scale(struct grim_output *output);
+// Bounding box of all outputs, in layout coordinates
+GRIM_EXPORT void grim_get_layout_extents(struct grim_state *state,
+	struct grim_box *box);
+// Greatest scale of the outputs in the box, or of all outputs if NULL
+GRIM_EXPORT double grim_get_greatest_scale(struct grim_state *state,
+	const struct grim_box *box);
+
+/**
+ * Provides the memory frames are copied into. Returns a file descriptor
+ * which can be mapped shared and read-write for size bytes from *offset,
+ * or -1 on error. The descriptor stays owned by the caller.
+ */
+typedef int (*grim_buffer_func)(void *data, struct grim_output *output,
+	size_t size, off_t *offset);
+
+/**
+ * Makes captures copy frames into memory provided by the caller. By
+ * default, grim allocates buffers itself and reuses them across captures
+ * of the same size.
+ */
+GRIM_EXPORT void grim_set_buffer_func(struct grim_state *state,
+	grim_buffer_func func, void *data);
+// Frees the buffers kept around for the next capture
+GRIM_EXPORT void grim_release_buffers(struct grim_state *state);
+// Number of times captures had to create a buffer rather than reuse one
+GRIM_EXPORT size_t grim_get_buffers_created(struct grim_state *state);
+
+/**
+ * Captures the outputs intersecting the box, or all outputs if NULL.
+ * Returns false if any of them couldn't be captured.
+ */
+GRIM_EXPORT bool grim_capture(struct grim_state *state,
+	const struct grim_box *box, bool with_cursor);
+
+/**
+ * Captures a single window, given its ext-foreign-toplevel-list-v1
+ * identifier, into a new a8r8g8b8 image of its own size. Only the window's
+ * buffer is copied, without whatever overlaps it on screen. Needs
+ * ext-image-copy-capture-v1 with toplevel sources. Returns NULL on error,
+ * listing the available toplevels if none has this identifier.
+ */
+GRIM_EXPORT pixman_image_t *grim_capture_toplevel(struct grim_state *state,
+	const char *identifier, bool with_cursor);
+
+enum grim_capture_status {
+	GRIM_CAPTURE_PENDING,
+	GRIM_CAPTURE_DONE,
+	GRIM_CAPTURE_FAILED,
+};
+
+/**
+ * Asynchronous captures, to drive several connections from a single event
+ * loop. grim_capture_start() queues the capture requests. Then, on each
+ * iteration, grim_prepare_poll() returns the file descriptor to poll for the
+ * given events, and grim_finish_poll() must be called with the returned
+ * events, even if none, to process them.
+ */
+GRIM_EXPORT bool grim_capture_start(struct grim_state *state,
+	const struct grim_box *box, bool with_cursor);
+GRIM_EXPORT int grim_prepare_poll(struct grim_state *state, short *events);
+GRIM_EXPORT enum grim_capture_status grim_finish_poll(struct grim_state *state,
+	short revents);
+
+/**
+ * Saves the last capture of each output to the directory, created if needed,
+ * so that it can be rendered again without a compositor.
+ */
+GRIM_EXPORT bool grim_dump(struct grim_state *state, const char *dir);
+/**
+ * Loads a capture saved by grim_dump(). The returned state can be rendered
+ * like a connected one, but not captured with. It is freed with
+ * grim_disconnect(). Returns NULL on error.
+ */
+GRIM_EXPORT struct grim_state *grim_load_dump(const char *dir);
+
+// Size of the image of the box at the given scale. Returns false if it is
+// empty or too large.
+GRIM_EXPORT bool grim_get_render_size(const struct grim_box *box,
+	double scale, int32_t *width, int32_t *height);
+GRIM_EXPORT void grim_set_scale_quality(struct grim_state *state,
+	enum grim_scale_quality quality);
+/**
+ * Composites the last capture of each output into a new a8r8g8b8 image of
+ * the box in layout coordinates, scaled by the given factor.
+ */
+GRIM_EXPORT pixman_image_t *grim_render(struct grim_state *state,
+	const struct grim_box *box, double scale);
+/**
+ * Same as grim_render(), into an existing image of the size given by
+ * grim_get_render_size(): a8r8g8b8, or any format without an alpha channel,
+ * e.g. to render into the pixels of a mapped file. The image must be cleared
+ * to zero beforehand, as new pixman images are: parts of outputs are copied
+ * rather than blended, and the rest is blended over what is there.
+ */
+GRIM_EXPORT bool grim_render_to_image(struct grim_state *state,
+	const struct grim_box *box, double scale, pixman_image_t *image);
+
+// Returns 0 on success, -1 on error
+typedef int (*grim_write_func)(void *data, const void *buf, size_t len);
+
+struct grim_encode_options {
+	enum grim_filetype filetype;
+	int quality; // JPEG 0-100, WebP 0-100 or -1 for lossless
+	int level; // PNG compression level or WebP effort, 0-9
+	long deadline_ms; // if positive, pick settings to fit in this time
+};
+
+GRIM_EXPORT void grim_init_encode_options(struct grim_encode_options *options,
+	enum grim_filetype filetype);
+// Returns false if support for the filetype wasn't built in
+GRIM_EXPORT bool grim_filetype_supported(enum grim_filetype filetype);
+// Same, but also loads the writer module of the filetype, returning false
+// if it can't be, e.g. because it isn't installed
+GRIM_EXPORT bool grim_filetype_available(enum grim_filetype filetype);
+/**
+ * Encodes an a8r8g8b8 or x8r8g8b8 image, passing the data to write as it
+ * is produced. Returns 0 on success, -1 on error.
+ */
+GRIM_EXPORT int grim_encode(pixman_image_t *image,
+	const struct grim_encode_options *options, grim_write_func write,
+	void *data);
+
+/**
+ * Reads a PNG or PPM image, e.g. to compare captures against, as a
+ * premultiplied a8r8g8b8 image, or x8r8g8b8 if it has no alpha channel.
+ * Returns NULL on error.
+ */
+GRIM_EXPORT pixman_image_t *grim_load_image(const char *path);
+
+/**
+ * Whether the image of the box at the given scale is too large for
+ * grim_render(), or takes more than budget bytes if not zero.
+ */
+GRIM_EXPORT bool grim_render_needs_bands(const struct grim_box *box,
+	double scale, size_t budget);
+/**
+ * Renders and encodes the box. If grim_render_needs_bands(), this is done
+ * in row bands fitting the budget, so that arbitrarily large layouts can be
+ * written; only PNG, PPM and JPEG support this. Returns 0 on success, -1 on
+ * error.
+ */
+GRIM_EXPORT int grim_render_encode(struct grim_state *state,
+	const struct grim_box *box, double scale, size_t budget,
+	const struct grim_encode_options *options, grim_write_func write,
+	void *data);
+
+struct grim_animation;
+
+/**
+ * Starts an animation of n_frames images of the same size, written as they
+ * are added. Only PNG supports this, producing an APNG where each frame only
+ * stores the rectangle which changed since the previous one. Returns NULL on
+ * error.
+ */
+GRIM_EXPORT struct grim_animation *grim_animation_begin(
+	const struct grim_encode_options *options, uint32_t n_frames,
+	grim_write_func write, void *data);
+// Adds an a8r8g8b8 or x8r8g8b8 frame, shown for delay_ms
+GRIM_EXPORT int grim_animation_add_frame(struct grim_animation *animation,
+	pixman_image_t *image, uint32_t delay_ms);
+/**
+ * Finishes the animation, which fails if fewer frames than announced were
+ * added, and frees it. Returns 0 on success, -1 on error.
+ */
+GRIM_EXPORT int grim_animation_end(struct grim_animation *animation);
+
+#endif
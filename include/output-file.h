@@ -0,0 +1,53 @@
+#ifndef _OUTPUT_FILE_H
+#define _OUTPUT_FILE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum output_file_sync {
+	OUTPUT_FILE_SYNC_NONE,
+	// fdatasync() once everything is written
+	OUTPUT_FILE_SYNC_FSYNC,
+	// Start writeback of each buffer as soon as it is written, then
+	// fdatasync() the rest
+	OUTPUT_FILE_SYNC_RANGE,
+};
+
+struct output_file_options {
+	bool direct; // O_DIRECT, if the filesystem supports it
+	enum output_file_sync sync;
+};
+
+struct output_file;
+
+/**
+ * Opens path for writing, or the standard output if it is "-". Data is
+ * gathered in large buffers, which are written while the next ones are
+ * filled: through io_uring if available, with plain write() otherwise.
+ */
+struct output_file *output_file_open(const char *path,
+	const struct output_file_options *options);
+// A grim_write_func, taking the output_file as data
+int output_file_write(void *data, const void *buf, size_t len);
+// Flushes, syncs as asked and closes the file. Returns false on error.
+bool output_file_close(struct output_file *file);
+
+struct output_map;
+
+// Whether a PPM image of this width can be rendered into in place: pixman
+// wants rows of whole 32-bit words
+bool output_map_ppm_supported(int32_t width);
+/**
+ * Creates a PPM file of the given size and maps it. Its pixels are exposed
+ * as an image without alpha channel, which can be rendered into directly.
+ * Returns NULL if the file can't be mapped, for instance if it isn't a
+ * regular file: it should then be written the usual way.
+ */
+struct output_map *output_map_ppm(const char *path, int32_t width,
+	int32_t height, pixman_image_t **image);
+// Unmaps and closes the file, syncing it as asked. Returns false on error.
+bool output_map_close(struct output_map *map, enum output_file_sync sync);
+
+#endif
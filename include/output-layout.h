@@ -1,10 +1,20 @@
 #ifndef _OUTPUT_LAYOUT_H
 #define _OUTPUT_LAYOUT_H
 
+#include <stdbool.h>
 #include <wayland-client.h>
 
 #include "grim.h"
 
+void build_output_layout(struct grim_state *state);
+// Builds the layout once all outputs have been described. Returns false if
+// some descriptions are still on their way.
+bool try_output_layout(struct grim_state *state);
+// Waits for the outputs to be described, then builds the layout once
+bool ensure_output_layout(struct grim_state *state);
+void finish_output_layout(struct grim_state *state);
+size_t find_outputs_in_box(struct grim_state *state, struct grim_box *box,
+	struct grim_output **outputs);
 void get_output_layout_extents(struct grim_state *state, struct grim_box *box);
 void apply_output_transform(enum wl_output_transform transform,
 	int32_t *width, int32_t *height);
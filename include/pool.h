@@ -0,0 +1,17 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*pool_task_func)(void *data);
+
+struct pool;
+
+// Falls back to running tasks on submission if no thread can be started
+struct pool *pool_create(size_t n_threads);
+bool pool_submit(struct pool *pool, pool_task_func func, void *data);
+// Runs the remaining tasks, then stops the threads and frees the pool
+void pool_finish(struct pool *pool);
+
+#endif
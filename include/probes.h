@@ -0,0 +1,16 @@
+#ifndef _PROBES_H
+#define _PROBES_H
+
+// USDT probes, for use with bpftrace, perf or SystemTap. They compile down
+// to a single nop when enabled, and to nothing at all otherwise.
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define GRIM_PROBE(...) STAP_PROBEV(grim, __VA_ARGS__)
+#else
+#define GRIM_PROBE(...) ((void)0)
+#endif
+
+// Writers report their progress every that many rows
+#define GRIM_PROBE_ROW_BATCH 64
+
+#endif
@@ -2,10 +2,25 @@
 #define _RENDER_H
 
 #include <pixman.h>
+#include <stdbool.h>
+#include <stdint.h>
 
+#include "buffer.h"
 #include "grim.h"
 
-pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
-	double scale);
+// Returns 0 if pixman can't read the format
+pixman_format_code_t get_pixman_format(enum wl_shm_format wl_fmt);
+
+// Size of the image of the box at the given scale. Returns false if it is
+// empty or doesn't fit in 32 bits.
+bool get_render_size(const struct grim_box *geometry, double scale,
+	int32_t *width, int32_t *height);
+// Renders the part of the image of the box at the given scale whose top-left
+// corner is at x, y into the image
+bool render_tile(struct grim_state *state, const struct grim_box *geometry,
+	double scale, pixman_image_t *image, int32_t x, int32_t y);
+// Copies a buffer into a new a8r8g8b8 image, undoing its transform
+pixman_image_t *render_buffer(struct grim_buffer *buffer,
+	enum wl_output_transform transform);
 
 #endif
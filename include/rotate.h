@@ -0,0 +1,15 @@
+#ifndef _ROTATE_H
+#define _ROTATE_H
+
+#include <pixman.h>
+#include <stdbool.h>
+
+#include "box.h"
+
+// Copies src into the box of dest when the transform from the box to src is
+// an exact rotation or flip of whole pixels, as pixman would with
+// PIXMAN_OP_SRC. Returns false without touching dest in any other case.
+bool blit_rotated(pixman_image_t *src, pixman_image_t *dest,
+	const struct pixman_transform *dest2src, const struct grim_box *dest_box);
+
+#endif
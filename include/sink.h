@@ -0,0 +1,29 @@
+#ifndef _SINK_H
+#define _SINK_H
+
+#include <stddef.h>
+
+#include "libgrim.h"
+
+// Where encoded data goes, through the caller's write callback
+struct grim_sink {
+	grim_write_func write;
+	void *data;
+	size_t written;
+};
+
+// Returns 0 on success, -1 on error. Inline, since the writer modules can't
+// link against libgrim internals.
+static inline int sink_write(struct grim_sink *sink, const void *buf,
+		size_t len) {
+	if (len == 0) {
+		return 0;
+	}
+	if (sink->write(sink->data, buf, len) != 0) {
+		return -1;
+	}
+	sink->written += len;
+	return 0;
+}
+
+#endif
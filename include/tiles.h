@@ -0,0 +1,18 @@
+#ifndef _TILES_H
+#define _TILES_H
+
+#include <pixman.h>
+#include <stdbool.h>
+
+#include "libgrim.h"
+
+/**
+ * Writes the image as a Deep Zoom pyramid in dir: the grim.dzi manifest,
+ * and grim_files/<level>/<column>_<row>.<ext> tiles, level 0 being a single
+ * pixel. Tiles whose pixels didn't change since the last pyramid written to
+ * dir are left alone.
+ */
+bool write_tiles(pixman_image_t *image, const char *dir,
+	const struct grim_encode_options *options);
+
+#endif
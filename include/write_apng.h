@@ -0,0 +1,21 @@
+#ifndef _WRITE_APNG_H
+#define _WRITE_APNG_H
+
+#include <pixman.h>
+#include <stdint.h>
+
+#include "sink.h"
+#include "write_png.h"
+
+struct grim_apng;
+
+// Frames are written to the sink as they are added, and must all have the
+// size of the first one
+struct grim_apng *apng_begin(struct grim_sink *sink,
+	const struct grim_png_params *params, uint32_t n_frames);
+int apng_add_frame(struct grim_apng *apng, pixman_image_t *image,
+	uint32_t delay_ms);
+// Writes the end of the file if all frames were added, and frees apng
+int apng_end(struct grim_apng *apng);
+
+#endif
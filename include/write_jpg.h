@@ -2,8 +2,22 @@
 #define _WRITE_JPEG_H
 
 #include <pixman.h>
-#include <stdio.h>
+#include <stdbool.h>
 
-int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality);
+#include "band.h"
+#include "sink.h"
+
+struct grim_jpeg_params {
+	int quality; // 0-100
+	bool fast_dct; // faster, slightly less accurate DCT
+	bool optimize; // compute optimal Huffman tables, smaller but slower
+	bool progressive;
+};
+
+void init_jpeg_params(struct grim_jpeg_params *params, int quality);
+int write_to_jpeg_sink(pixman_image_t *image, struct grim_sink *sink,
+	const struct grim_jpeg_params *params);
+int write_bands_to_jpeg_sink(const struct grim_band_source *source,
+	struct grim_sink *sink, const struct grim_jpeg_params *params);
 
 #endif
@@ -2,8 +2,29 @@
 #define _WRITE_PNG_H
 
 #include <pixman.h>
-#include <stdio.h>
+#include <stdbool.h>
 
-int write_to_png_stream(pixman_image_t *image, FILE *stream, int comp_level);
+#include "band.h"
+#include "libgrim.h"
+#include "sink.h"
+
+struct grim_png_params {
+	int comp_level; // zlib compression level, 0-9
+	int filters; // PNG_FILTER_* flags
+	int strategy; // zlib strategy, or -1 for libpng's default
+};
+
+void init_png_params(struct grim_png_params *params, int comp_level);
+int write_to_png_sink(pixman_image_t *image, struct grim_sink *sink,
+	const struct grim_png_params *params);
+// Whether all pixels are opaque, in which case the alpha channel is dropped
+bool is_image_opaque(pixman_image_t *image);
+// Writes a standalone PNG of a rectangle of the image
+int write_png_rect_to_sink(pixman_image_t *image, const struct grim_box *rect,
+	bool fully_opaque, struct grim_sink *sink,
+	const struct grim_png_params *params);
+// Always RGBA, since the image isn't known in advance
+int write_bands_to_png_sink(const struct grim_band_source *source,
+	struct grim_sink *sink, const struct grim_png_params *params);
 
 #endif
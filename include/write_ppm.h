@@ -2,8 +2,12 @@
 #define _WRITE_PPM_H
 
 #include <pixman.h>
-#include <stdio.h>
 
-int write_to_ppm_stream(pixman_image_t *image, FILE *stream);
+#include "band.h"
+#include "sink.h"
+
+int write_to_ppm_sink(pixman_image_t *image, struct grim_sink *sink);
+int write_bands_to_ppm_sink(const struct grim_band_source *source,
+	struct grim_sink *sink);
 
 #endif
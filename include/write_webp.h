@@ -0,0 +1,11 @@
+#ifndef _WRITE_WEBP_H
+#define _WRITE_WEBP_H
+
+#include <pixman.h>
+
+#include "sink.h"
+
+int write_to_webp_sink(pixman_image_t *image, struct grim_sink *sink,
+	int quality, int level);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _WRITER_H
+#define _WRITER_H
+
+#include <pixman.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "band.h"
+#include "libgrim.h"
+#include "sink.h"
+
+// Bumped whenever struct grim_writer or what it relies on changes, so that
+// stale modules are refused instead of crashing
+#define GRIM_WRITER_VERSION 5
+
+// Entry point of a writer module, exported under the name "grim_writer"
+struct grim_writer {
+	int version;
+	const char *name;
+	int (*encode)(pixman_image_t *image, struct grim_sink *sink,
+		const struct grim_encode_options *options);
+	// Encodes an image rendered band by band, NULL if the filetype can't
+	// be written row by row
+	int (*encode_bands)(const struct grim_band_source *source,
+		struct grim_sink *sink, const struct grim_encode_options *options);
+	// Reads a file of this type back into an a8r8g8b8 image, or x8r8g8b8
+	// if it has no alpha. NULL if unsupported.
+	pixman_image_t *(*decode)(FILE *file);
+	// Animations, written to the sink frame by frame. NULL if unsupported.
+	void *(*animation_begin)(struct grim_sink *sink,
+		const struct grim_encode_options *options, uint32_t n_frames);
+	int (*animation_add_frame)(void *animation, pixman_image_t *image,
+		uint32_t delay_ms);
+	int (*animation_end)(void *animation);
+};
+
+// Loads the module of the filetype on first use. Returns NULL on error.
+const struct grim_writer *get_writer(enum grim_filetype filetype);
+
+#endif
@@ -1,7 +1,10 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <math.h>
 #include <pixman.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,179 +14,225 @@
 #include <unistd.h>
 #include <wordexp.h>
 
-#include "buffer.h"
-#include "grim.h"
-#include "output-layout.h"
-#include "render.h"
-#include "write_ppm.h"
-#ifdef HAVE_JPEG
-#include "write_jpg.h"
-#endif
-#include "write_png.h"
-
-static void screencopy_frame_handle_buffer(void *data,
-		struct zwlr_screencopy_frame_v1 *frame, uint32_t format, uint32_t width,
-		uint32_t height, uint32_t stride) {
-	struct grim_output *output = data;
-
-	output->buffer =
-		create_buffer(output->state->shm, format, width, height, stride);
-	if (output->buffer == NULL) {
-		fprintf(stderr, "failed to create buffer\n");
-		exit(EXIT_FAILURE);
-	}
-
-	zwlr_screencopy_frame_v1_copy(frame, output->buffer->wl_buffer);
-}
-
-static void screencopy_frame_handle_flags(void *data,
-		struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
-	struct grim_output *output = data;
-	output->screencopy_frame_flags = flags;
-}
-
-static void screencopy_frame_handle_ready(void *data,
-		struct zwlr_screencopy_frame_v1 *frame, uint32_t tv_sec_hi,
-		uint32_t tv_sec_lo, uint32_t tv_nsec) {
-	struct grim_output *output = data;
-	++output->state->n_done;
-}
-
-static void screencopy_frame_handle_failed(void *data,
-		struct zwlr_screencopy_frame_v1 *frame) {
-	struct grim_output *output = data;
-	fprintf(stderr, "failed to copy output %s\n", output->name);
-	exit(EXIT_FAILURE);
-}
-
-static const struct zwlr_screencopy_frame_v1_listener screencopy_frame_listener = {
-	.buffer = screencopy_frame_handle_buffer,
-	.flags = screencopy_frame_handle_flags,
-	.ready = screencopy_frame_handle_ready,
-	.failed = screencopy_frame_handle_failed,
-};
-
-
-static void xdg_output_handle_logical_position(void *data,
-		struct zxdg_output_v1 *xdg_output, int32_t x, int32_t y) {
-	struct grim_output *output = data;
-
-	output->logical_geometry.x = x;
-	output->logical_geometry.y = y;
+#include "bench.h"
+#include "box.h"
+#include "clipboard.h"
+#include "compare.h"
+#include "displays.h"
+#include "handoff.h"
+#include "hash.h"
+#include "libgrim.h"
+#include "output-file.h"
+#include "tiles.h"
+
+static struct grim_box *parse_geometry(const char *str) {
+	struct grim_box *geometry = calloc(1, sizeof(struct grim_box));
+	if (geometry == NULL || !parse_box(geometry, str)) {
+		fprintf(stderr, "invalid geometry\n");
+		free(geometry);
+		return NULL;
+	}
+	return geometry;
 }
 
-static void xdg_output_handle_logical_size(void *data,
-		struct zxdg_output_v1 *xdg_output, int32_t width, int32_t height) {
-	struct grim_output *output = data;
-
-	output->logical_geometry.width = width;
-	output->logical_geometry.height = height;
-}
+static struct grim_box *read_geometry(FILE *file) {
+	char *geometry_str = NULL;
+	size_t n = 0;
+	ssize_t nread = getline(&geometry_str, &n, file);
+	if (nread < 0) {
+		free(geometry_str);
+		fprintf(stderr, "failed to read a line from stdin\n");
+		return NULL;
+	}
 
-static void xdg_output_handle_done(void *data,
-		struct zxdg_output_v1 *xdg_output) {
-	struct grim_output *output = data;
+	if (nread > 0 && geometry_str[nread - 1] == '\n') {
+		geometry_str[nread - 1] = '\0';
+	}
 
-	// Guess the output scale from the logical size
-	int32_t width = output->geometry.width;
-	int32_t height = output->geometry.height;
-	apply_output_transform(output->transform, &width, &height);
-	output->logical_scale = (double)width / output->logical_geometry.width;
+	struct grim_box *geometry = parse_geometry(geometry_str);
+	free(geometry_str);
+	return geometry;
 }
 
-static void xdg_output_handle_name(void *data,
-		struct zxdg_output_v1 *xdg_output, const char *name) {
-	struct grim_output *output = data;
-	output->name = strdup(name);
+// Exit status when --skip-unchanged finds the same image as last time
+#define EXIT_UNCHANGED 2
+// Exit status when --compare finds differences
+#define EXIT_MISMATCH 3
+
+// Returns false if there is no previous hash, or it can't be read
+static bool read_state_file(const char *path, uint64_t *hash) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		if (errno != ENOENT) {
+			fprintf(stderr, "failed to open state file '%s': %s\n", path,
+				strerror(errno));
+		}
+		return false;
+	}
+	bool ok = fscanf(f, "%" SCNx64, hash) == 1;
+	fclose(f);
+	return ok;
 }
 
-static void xdg_output_handle_description(void *data,
-		struct zxdg_output_v1 *xdg_output, const char *name) {
-	// No-op
+static bool write_state_file(const char *path, uint64_t hash) {
+	// Replaced at once, so that a concurrent run never reads half of it
+	size_t tmp_len = strlen(path) + sizeof(".tmp");
+	char *tmp_path = malloc(tmp_len);
+	if (tmp_path == NULL) {
+		return false;
+	}
+	snprintf(tmp_path, tmp_len, "%s.tmp", path);
+
+	bool ok = false;
+	FILE *f = fopen(tmp_path, "w");
+	if (f != NULL) {
+		ok = fprintf(f, "%016" PRIx64 "\n", hash) > 0;
+		ok = fclose(f) == 0 && ok;
+		ok = ok && rename(tmp_path, path) == 0;
+	}
+	if (!ok) {
+		fprintf(stderr, "failed to write state file '%s': %s\n", path,
+			strerror(errno));
+		unlink(tmp_path);
+	}
+	free(tmp_path);
+	return ok;
 }
 
-static const struct zxdg_output_v1_listener xdg_output_listener = {
-	.logical_position = xdg_output_handle_logical_position,
-	.logical_size = xdg_output_handle_logical_size,
-	.done = xdg_output_handle_done,
-	.name = xdg_output_handle_name,
-	.description = xdg_output_handle_description,
-};
-
-
-static void output_handle_geometry(void *data, struct wl_output *wl_output,
-		int32_t x, int32_t y, int32_t physical_width, int32_t physical_height,
-		int32_t subpixel, const char *make, const char *model,
-		int32_t transform) {
-	struct grim_output *output = data;
-
-	output->geometry.x = x;
-	output->geometry.y = y;
-	output->transform = transform;
-}
+// Returns 0 if the images match, 1 if they differ, -1 on error. A diff is
+// made if they differ in pixels, and not if they differ in size.
+static int compare_image(pixman_image_t *image,
+		const struct grim_box *geometry, double scale, const char *ref_path,
+		int tolerance, const struct grim_box *masks, size_t n_masks,
+		FILE *report, pixman_image_t **diff) {
+	*diff = NULL;
+	pixman_image_t *ref = grim_load_image(ref_path);
+	if (ref == NULL) {
+		return -1;
+	}
 
-static void output_handle_mode(void *data, struct wl_output *wl_output,
-		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-	struct grim_output *output = data;
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	if (pixman_image_get_width(ref) != width ||
+			pixman_image_get_height(ref) != height) {
+		fprintf(report, "size differs: %dx%d, expected %dx%d\n", width, height,
+			pixman_image_get_width(ref), pixman_image_get_height(ref));
+		pixman_image_unref(ref);
+		return 1;
+	}
 
-	if ((flags & WL_OUTPUT_MODE_CURRENT) != 0) {
-		output->geometry.width = width;
-		output->geometry.height = height;
+	// Masks are given in layout coordinates, like the geometry
+	struct grim_box *pixel_masks = calloc(n_masks, sizeof(struct grim_box));
+	if (n_masks > 0 && pixel_masks == NULL) {
+		fprintf(stderr, "failed to allocate masks\n");
+		pixman_image_unref(ref);
+		return -1;
+	}
+	for (size_t i = 0; i < n_masks; i++) {
+		int32_t x1 = floor((masks[i].x - geometry->x) * scale);
+		int32_t y1 = floor((masks[i].y - geometry->y) * scale);
+		int32_t x2 = ceil((masks[i].x + masks[i].width - geometry->x) * scale);
+		int32_t y2 = ceil((masks[i].y + masks[i].height - geometry->y) * scale);
+		pixel_masks[i] = (struct grim_box){ x1, y1, x2 - x1, y2 - y1 };
 	}
+	struct compare_options options = {
+		.tolerance = tolerance,
+		.masks = pixel_masks,
+		.n_masks = n_masks,
+	};
+
+	struct compare_result result;
+	compare_images(image, ref, &options, NULL, &result);
+	fprintf(report, "%" PRIu64 " pixels changed", result.n_changed);
+	if (result.n_changed > 0) {
+		fprintf(report, ", bounding box %d,%d %dx%d", result.bounds.x,
+			result.bounds.y, result.bounds.width, result.bounds.height);
+	}
+	fprintf(report, "\n");
+
+	int ret = result.n_changed > 0;
+	if (result.n_changed > 0) {
+		*diff = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
+			NULL, 0);
+		if (*diff != NULL) {
+			compare_images(image, ref, &options, *diff, &result);
+		} else {
+			fprintf(stderr, "failed to allocate diff image\n");
+			ret = -1;
+		}
+	}
+	free(pixel_masks);
+	pixman_image_unref(ref);
+	return ret;
 }
 
-static void output_handle_done(void *data, struct wl_output *wl_output) {
-	// No-op
-}
+// Adds the first frame, already captured and rendered, then captures the
+// others at a fixed rate
+static bool capture_animation(struct grim_state *state,
+		const struct grim_box *geometry, double scale, bool with_cursor,
+		pixman_image_t *first, uint32_t n_frames, uint32_t interval_ms,
+		const struct grim_encode_options *options, struct output_file *file) {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct grim_animation *animation =
+		grim_animation_begin(options, n_frames, output_file_write, file);
+	if (animation == NULL) {
+		return false;
+	}
+	bool ok = grim_animation_add_frame(animation, first, interval_ms) == 0;
+	for (uint32_t i = 1; ok && i < n_frames; i++) {
+		// Scheduled from the start rather than from the previous frame,
+		// so that slow captures don't make the animation drift
+		uint64_t offset_ns = (uint64_t)i * interval_ms * 1000000;
+		struct timespec next = {
+			.tv_sec = start.tv_sec + offset_ns / 1000000000,
+			.tv_nsec = start.tv_nsec + offset_ns % 1000000000,
+		};
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000;
+		}
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				NULL) == EINTR) {
+			// Keep waiting
+		}
 
-static void output_handle_scale(void *data, struct wl_output *wl_output,
-		int32_t factor) {
-	struct grim_output *output = data;
-	output->scale = factor;
+		if (!grim_capture(state, geometry, with_cursor)) {
+			ok = false;
+			break;
+		}
+		pixman_image_t *image = grim_render(state, geometry, scale);
+		if (image == NULL) {
+			ok = false;
+			break;
+		}
+		ok = grim_animation_add_frame(animation, image, interval_ms) == 0;
+		pixman_image_unref(image);
+	}
+	// Always called, to free the animation
+	if (grim_animation_end(animation) != 0) {
+		ok = false;
+	}
+	return ok;
 }
 
-static const struct wl_output_listener output_listener = {
-	.geometry = output_handle_geometry,
-	.mode = output_handle_mode,
-	.done = output_handle_done,
-	.scale = output_handle_scale,
-};
-
-
-static void handle_global(void *data, struct wl_registry *registry,
-		uint32_t name, const char *interface, uint32_t version) {
-	struct grim_state *state = data;
-
-	if (strcmp(interface, wl_shm_interface.name) == 0) {
-		state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
-	} else if (strcmp(interface, zxdg_output_manager_v1_interface.name) == 0) {
-		uint32_t bind_version = (version > 2) ? 2 : version;
-		state->xdg_output_manager = wl_registry_bind(registry, name,
-			&zxdg_output_manager_v1_interface, bind_version);
-	} else if (strcmp(interface, wl_output_interface.name) == 0) {
-		struct grim_output *output = calloc(1, sizeof(struct grim_output));
-		output->state = state;
-		output->scale = 1;
-		output->wl_output =  wl_registry_bind(registry, name,
-			&wl_output_interface, 3);
-		wl_output_add_listener(output->wl_output, &output_listener, output);
-		wl_list_insert(&state->outputs, &output->link);
-	} else if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
-		state->screencopy_manager = wl_registry_bind(registry, name,
-			&zwlr_screencopy_manager_v1_interface, 1);
+static bool detach_process(void) {
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return false;
+	} else if (pid > 0) {
+		// The caller only waits for the parent, the child does the encoding
+		_exit(EXIT_SUCCESS);
 	}
-}
 
-static void handle_global_remove(void *data, struct wl_registry *registry,
-		uint32_t name) {
-	// who cares
+	if (setsid() < 0) {
+		perror("setsid");
+	}
+	return true;
 }
 
-static const struct wl_registry_listener registry_listener = {
-	.global = handle_global,
-	.global_remove = handle_global_remove,
-};
-
 static bool default_filename(char *filename, size_t n, int filetype) {
 	time_t time_epoch = time(NULL);
 	struct tm *time = localtime(&time_epoch);
@@ -202,12 +251,11 @@ static bool default_filename(char *filename, size_t n, int filetype) {
 		ext = "ppm";
 		break;
 	case GRIM_FILETYPE_JPEG:
-#if HAVE_JPEG
 		ext = "jpeg";
 		break;
-#else
-		abort();
-#endif
+	case GRIM_FILETYPE_WEBP:
+		ext = "webp";
+		break;
 	}
 	assert(ext != NULL);
 	char tmpstr[32];
@@ -313,23 +361,140 @@ static const char usage[] =
 	"  -s <factor>     Set the output image scale factor. Defaults to the\n"
 	"                  greatest output scale factor.\n"
 	"  -g <geometry>   Set the region to capture.\n"
-	"  -t png|ppm|jpeg Set the output filetype. Defaults to png.\n"
+	"  -t png|ppm|jpeg|webp\n"
+	"                  Set the output filetype. Defaults to png.\n"
 	"  -q <quality>    Set the JPEG filetype quality 0-100. Defaults to 80.\n"
+	"                  For WebP, switch to lossy encoding with this quality.\n"
 	"  -l <level>      Set the PNG filetype compression level 0-9. Defaults to 6.\n"
+	"                  For WebP, set the encoding effort 0-9.\n"
 	"  -o <output>     Set the output name to capture.\n"
-	"  -c              Include cursors in the screenshot.\n";
+	"  -T <identifier> Capture this window only, given its foreign toplevel\n"
+	"                  identifier.\n"
+	"  -c              Include cursors in the screenshot.\n"
+	"  -d              Detach after capture, returning before the image\n"
+	"                  is encoded and written.\n"
+	"  -m <socket>     Send the raw image in a memfd over a UNIX socket\n"
+	"                  instead of writing a file.\n"
+	"  --deadline <ms> Choose the encoder settings giving the smallest file\n"
+	"                  that can be encoded within the given time.\n"
+	"  --scale-quality fast|good|best\n"
+	"                  Set the filter quality when downscaling by more than\n"
+	"                  half. Defaults to good.\n"
+	"  --freeze        Capture as soon as grim starts, before reading the\n"
+	"                  geometry from the standard input.\n"
+	"  --display <name>\n"
+	"                  Connect to this Wayland display. If repeated, capture\n"
+	"                  all of them at once, writing one file per display.\n"
+	"  --clipboard     Copy the image to the clipboard instead of writing a\n"
+	"                  file, and keep serving it in the background.\n"
+	"  --dump <dir>    Save the captured frames and output descriptions to\n"
+	"                  this directory.\n"
+	"  --from-dump <dir>\n"
+	"                  Render a capture saved with --dump instead of\n"
+	"                  capturing.\n"
+	"  --memory-budget <MiB>\n"
+	"                  Render and encode larger images in bands using at\n"
+	"                  most this much memory.\n"
+	"  --skip-unchanged <state-file>\n"
+	"                  Don't write anything and exit with status 2 if the\n"
+	"                  image is the same as the last time this file was used.\n"
+	"  --compare <ref> Compare the image with a PNG or PPM reference, and only\n"
+	"                  write a diff image if they differ, exiting with status 3.\n"
+	"  --tolerance <n> Ignore channel differences up to n when comparing.\n"
+	"  --mask <geometry>\n"
+	"                  Ignore this region when comparing. Can be repeated.\n"
+	"  --frames <n>    Capture n frames into an animated PNG.\n"
+	"  --interval <ms> Set the time between frames. Defaults to 100.\n"
+	"  --tiles <dir>   Write a Deep Zoom tile pyramid to this directory\n"
+	"                  instead of a single file.\n"
+	"  --direct        Write the output file with O_DIRECT, bypassing the page\n"
+	"                  cache.\n"
+	"  --sync fsync|range\n"
+	"                  Make sure the output file is on disk before exiting,\n"
+	"                  with a single fdatasync or by flushing as it's written.\n"
+	"  --bench <n>     Capture, render and encode n images without writing\n"
+	"                  them, and print how long each step took.\n";
+
+enum {
+	OPT_DEADLINE = 256,
+	OPT_SCALE_QUALITY,
+	OPT_FREEZE,
+	OPT_DISPLAY,
+	OPT_CLIPBOARD,
+	OPT_DUMP,
+	OPT_FROM_DUMP,
+	OPT_MEMORY_BUDGET,
+	OPT_SKIP_UNCHANGED,
+	OPT_COMPARE,
+	OPT_TOLERANCE,
+	OPT_MASK,
+	OPT_FRAMES,
+	OPT_INTERVAL,
+	OPT_TILES,
+	OPT_DIRECT,
+	OPT_SYNC,
+	OPT_BENCH,
+};
+
+static const struct option long_options[] = {
+	{"deadline", required_argument, NULL, OPT_DEADLINE},
+	{"scale-quality", required_argument, NULL, OPT_SCALE_QUALITY},
+	{"freeze", no_argument, NULL, OPT_FREEZE},
+	{"display", required_argument, NULL, OPT_DISPLAY},
+	{"clipboard", no_argument, NULL, OPT_CLIPBOARD},
+	{"dump", required_argument, NULL, OPT_DUMP},
+	{"from-dump", required_argument, NULL, OPT_FROM_DUMP},
+	{"memory-budget", required_argument, NULL, OPT_MEMORY_BUDGET},
+	{"skip-unchanged", required_argument, NULL, OPT_SKIP_UNCHANGED},
+	{"compare", required_argument, NULL, OPT_COMPARE},
+	{"tolerance", required_argument, NULL, OPT_TOLERANCE},
+	{"mask", required_argument, NULL, OPT_MASK},
+	{"frames", required_argument, NULL, OPT_FRAMES},
+	{"interval", required_argument, NULL, OPT_INTERVAL},
+	{"tiles", required_argument, NULL, OPT_TILES},
+	{"direct", no_argument, NULL, OPT_DIRECT},
+	{"sync", required_argument, NULL, OPT_SYNC},
+	{"bench", required_argument, NULL, OPT_BENCH},
+	{0},
+};
 
 int main(int argc, char *argv[]) {
 	double scale = 1.0;
 	bool use_greatest_scale = true;
 	struct grim_box *geometry = NULL;
 	char *geometry_output = NULL;
+	char *toplevel_id = NULL;
 	enum grim_filetype output_filetype = GRIM_FILETYPE_PNG;
 	int jpeg_quality = 80;
 	int png_level = 6; // current default png/zlib compression level
+	int webp_quality = -1; // lossless unless a quality is given
+	int webp_level = 6;
 	bool with_cursor = false;
+	bool detach = false;
+	char *handoff_target = NULL;
+	bool geometry_from_stdin = false;
+	bool freeze = false;
+	char **display_names = NULL;
+	size_t n_displays = 0;
+	bool clipboard = false;
+	char *dump_dir = NULL;
+	char *from_dump_dir = NULL;
+	size_t memory_budget = 0;
+	char *state_path = NULL;
+	char *compare_path = NULL;
+	int tolerance = 0;
+	struct grim_box *masks = NULL;
+	size_t n_masks = 0;
+	uint32_t n_frames = 1;
+	uint32_t interval_ms = 100;
+	char *tiles_dir = NULL;
+	struct output_file_options file_options = {0};
+	uint32_t n_bench_runs = 0;
+	long deadline_ms = 0;
+	enum grim_scale_quality scale_quality = GRIM_SCALE_QUALITY_GOOD;
 	int opt;
-	while ((opt = getopt(argc, argv, "hs:g:t:q:l:o:c")) != -1) {
+	while ((opt = getopt_long(argc, argv, "hs:g:t:q:l:o:T:cdm:",
+			long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
 			printf("%s", usage);
@@ -338,32 +503,18 @@ int main(int argc, char *argv[]) {
 			use_greatest_scale = false;
 			scale = strtod(optarg, NULL);
 			break;
-		case 'g':;
-			char *geometry_str = NULL;
-			if (strcmp(optarg, "-") == 0) {
-				size_t n = 0;
-				ssize_t nread = getline(&geometry_str, &n, stdin);
-				if (nread < 0) {
-					free(geometry_str);
-					fprintf(stderr, "failed to read a line from stdin\n");
+		case 'g':
+			free(geometry);
+			geometry = NULL;
+			// Read later, so that the selection doesn't hold up the
+			// connection
+			geometry_from_stdin = strcmp(optarg, "-") == 0;
+			if (!geometry_from_stdin) {
+				geometry = parse_geometry(optarg);
+				if (geometry == NULL) {
 					return EXIT_FAILURE;
 				}
-
-				if (nread > 0 && geometry_str[nread - 1] == '\n') {
-					geometry_str[nread - 1] = '\0';
-				}
-			} else {
-				geometry_str = strdup(optarg);
 			}
-
-			free(geometry);
-			geometry = calloc(1, sizeof(struct grim_box));
-			if (!parse_box(geometry, geometry_str)) {
-				fprintf(stderr, "invalid geometry\n");
-				return EXIT_FAILURE;
-			}
-
-			free(geometry_str);
 			break;
 		case 't':
 			if (strcmp(optarg, "png") == 0) {
@@ -371,48 +522,55 @@ int main(int argc, char *argv[]) {
 			} else if (strcmp(optarg, "ppm") == 0) {
 				output_filetype = GRIM_FILETYPE_PPM;
 			} else if (strcmp(optarg, "jpeg") == 0) {
-#ifdef HAVE_JPEG
 				output_filetype = GRIM_FILETYPE_JPEG;
-#else
-				fprintf(stderr, "jpeg support disabled\n");
-				return EXIT_FAILURE;
-#endif
+			} else if (strcmp(optarg, "webp") == 0) {
+				output_filetype = GRIM_FILETYPE_WEBP;
 			} else {
 				fprintf(stderr, "invalid filetype\n");
 				return EXIT_FAILURE;
 			}
+			if (!grim_filetype_supported(output_filetype)) {
+				fprintf(stderr, "%s support disabled\n", optarg);
+				return EXIT_FAILURE;
+			}
 			break;
 		case 'q':
-			if (output_filetype != GRIM_FILETYPE_JPEG) {
-				fprintf(stderr, "quality is used only for jpeg files\n");
+			if (output_filetype != GRIM_FILETYPE_JPEG &&
+					output_filetype != GRIM_FILETYPE_WEBP) {
+				fprintf(stderr, "quality is used only for jpeg and webp files\n");
 				return EXIT_FAILURE;
 			} else {
+				int *quality = output_filetype == GRIM_FILETYPE_JPEG ?
+					&jpeg_quality : &webp_quality;
 				char *endptr = NULL;
 				errno = 0;
-				jpeg_quality = strtol(optarg, &endptr, 10);
+				*quality = strtol(optarg, &endptr, 10);
 				if (*endptr != '\0' || errno) {
 					fprintf(stderr, "quality must be a integer\n");
 					return EXIT_FAILURE;
 				}
-				if (jpeg_quality < 0 || jpeg_quality > 100) {
+				if (*quality < 0 || *quality > 100) {
 					fprintf(stderr, "quality valid values are between 0-100\n");
 					return EXIT_FAILURE;
 				}
 			}
 			break;
 		case 'l':
-			if (output_filetype != GRIM_FILETYPE_PNG) {
-				fprintf(stderr, "compression level is used only for png files\n");
+			if (output_filetype != GRIM_FILETYPE_PNG &&
+					output_filetype != GRIM_FILETYPE_WEBP) {
+				fprintf(stderr, "compression level is used only for png and webp files\n");
 				return EXIT_FAILURE;
 			} else {
+				int *level = output_filetype == GRIM_FILETYPE_PNG ?
+					&png_level : &webp_level;
 				char *endptr = NULL;
 				errno = 0;
-				png_level = strtol(optarg, &endptr, 10);
+				*level = strtol(optarg, &endptr, 10);
 				if (*endptr != '\0' || errno) {
 					fprintf(stderr, "level must be a integer\n");
 					return EXIT_FAILURE;
 				}
-				if (png_level < 0 || png_level > 9) {
+				if (*level < 0 || *level > 9) {
 					fprintf(stderr, "compression level valid values are between 0-9\n");
 					return EXIT_FAILURE;
 				}
@@ -422,14 +580,237 @@ int main(int argc, char *argv[]) {
 			free(geometry_output);
 			geometry_output = strdup(optarg);
 			break;
+		case 'T':
+			free(toplevel_id);
+			toplevel_id = strdup(optarg);
+			break;
 		case 'c':
 			with_cursor = true;
 			break;
+		case 'd':
+			detach = true;
+			break;
+		case 'm':
+			free(handoff_target);
+			handoff_target = strdup(optarg);
+			break;
+		case OPT_DEADLINE:;
+			char *endptr = NULL;
+			errno = 0;
+			deadline_ms = strtol(optarg, &endptr, 10);
+			if (*endptr != '\0' || errno) {
+				fprintf(stderr, "deadline must be a integer\n");
+				return EXIT_FAILURE;
+			}
+			if (deadline_ms <= 0) {
+				fprintf(stderr, "deadline must be positive\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_SCALE_QUALITY:
+			if (strcmp(optarg, "fast") == 0) {
+				scale_quality = GRIM_SCALE_QUALITY_FAST;
+			} else if (strcmp(optarg, "good") == 0) {
+				scale_quality = GRIM_SCALE_QUALITY_GOOD;
+			} else if (strcmp(optarg, "best") == 0) {
+				scale_quality = GRIM_SCALE_QUALITY_BEST;
+			} else {
+				fprintf(stderr, "invalid scale quality\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_FREEZE:
+			freeze = true;
+			break;
+		case OPT_DISPLAY:;
+			char **names = realloc(display_names,
+				(n_displays + 1) * sizeof(char *));
+			if (names == NULL) {
+				fprintf(stderr, "failed to allocate displays\n");
+				return EXIT_FAILURE;
+			}
+			display_names = names;
+			display_names[n_displays++] = strdup(optarg);
+			break;
+		case OPT_CLIPBOARD:
+			clipboard = true;
+			break;
+		case OPT_DUMP:
+			free(dump_dir);
+			dump_dir = strdup(optarg);
+			break;
+		case OPT_FROM_DUMP:
+			free(from_dump_dir);
+			from_dump_dir = strdup(optarg);
+			break;
+		case OPT_MEMORY_BUDGET:;
+			char *budget_end = NULL;
+			errno = 0;
+			long budget_mib = strtol(optarg, &budget_end, 10);
+			if (*budget_end != '\0' || errno) {
+				fprintf(stderr, "memory budget must be a integer\n");
+				return EXIT_FAILURE;
+			}
+			if (budget_mib <= 0 || (unsigned long)budget_mib > SIZE_MAX >> 20) {
+				fprintf(stderr, "memory budget must be positive\n");
+				return EXIT_FAILURE;
+			}
+			memory_budget = (size_t)budget_mib << 20;
+			break;
+		case OPT_SKIP_UNCHANGED:
+			free(state_path);
+			state_path = strdup(optarg);
+			break;
+		case OPT_COMPARE:
+			free(compare_path);
+			compare_path = strdup(optarg);
+			break;
+		case OPT_TOLERANCE:;
+			char *tolerance_end = NULL;
+			errno = 0;
+			tolerance = strtol(optarg, &tolerance_end, 10);
+			if (*tolerance_end != '\0' || errno) {
+				fprintf(stderr, "tolerance must be a integer\n");
+				return EXIT_FAILURE;
+			}
+			if (tolerance < 0 || tolerance > 255) {
+				fprintf(stderr, "tolerance valid values are between 0-255\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_MASK:;
+			struct grim_box *new_masks = realloc(masks,
+				(n_masks + 1) * sizeof(struct grim_box));
+			if (new_masks == NULL) {
+				fprintf(stderr, "failed to allocate masks\n");
+				return EXIT_FAILURE;
+			}
+			masks = new_masks;
+			if (!parse_box(&masks[n_masks], optarg)) {
+				fprintf(stderr, "invalid mask geometry\n");
+				return EXIT_FAILURE;
+			}
+			n_masks++;
+			break;
+		case OPT_FRAMES:;
+			char *frames_end = NULL;
+			errno = 0;
+			long frames = strtol(optarg, &frames_end, 10);
+			if (*frames_end != '\0' || errno) {
+				fprintf(stderr, "frames must be a integer\n");
+				return EXIT_FAILURE;
+			}
+			if (frames <= 0 || frames > INT32_MAX) {
+				fprintf(stderr, "frames must be positive\n");
+				return EXIT_FAILURE;
+			}
+			n_frames = frames;
+			break;
+		case OPT_INTERVAL:;
+			char *interval_end = NULL;
+			errno = 0;
+			long interval = strtol(optarg, &interval_end, 10);
+			if (*interval_end != '\0' || errno) {
+				fprintf(stderr, "interval must be a integer\n");
+				return EXIT_FAILURE;
+			}
+			// The APNG frame delay is 16 bits
+			if (interval <= 0 || interval > UINT16_MAX) {
+				fprintf(stderr, "interval valid values are between 1-65535\n");
+				return EXIT_FAILURE;
+			}
+			interval_ms = interval;
+			break;
+		case OPT_TILES:
+			free(tiles_dir);
+			tiles_dir = strdup(optarg);
+			break;
+		case OPT_DIRECT:
+			file_options.direct = true;
+			break;
+		case OPT_SYNC:
+			if (strcmp(optarg, "fsync") == 0) {
+				file_options.sync = OUTPUT_FILE_SYNC_FSYNC;
+			} else if (strcmp(optarg, "range") == 0) {
+				file_options.sync = OUTPUT_FILE_SYNC_RANGE;
+			} else {
+				fprintf(stderr, "invalid sync mode\n");
+				return EXIT_FAILURE;
+			}
+			break;
+		case OPT_BENCH:;
+			char *bench_end = NULL;
+			errno = 0;
+			long bench_runs = strtol(optarg, &bench_end, 10);
+			if (*bench_end != '\0' || errno) {
+				fprintf(stderr, "bench runs must be a integer\n");
+				return EXIT_FAILURE;
+			}
+			if (bench_runs <= 0 || bench_runs > INT32_MAX) {
+				fprintf(stderr, "bench runs must be positive\n");
+				return EXIT_FAILURE;
+			}
+			n_bench_runs = bench_runs;
+			break;
 		default:
 			return EXIT_FAILURE;
 		}
 	}
 
+	if (clipboard && (optind < argc || handoff_target != NULL ||
+			n_displays > 1)) {
+		fprintf(stderr, "--clipboard can't be used with an output file, "
+			"-m or multiple displays\n");
+		return EXIT_FAILURE;
+	}
+
+	if (n_frames > 1 && (output_filetype != GRIM_FILETYPE_PNG ||
+			handoff_target != NULL || clipboard || compare_path != NULL ||
+			state_path != NULL || from_dump_dir != NULL || n_displays > 1 ||
+			detach || freeze)) {
+		fprintf(stderr, "--frames can only be used to write a png file, "
+			"without -d, -m, --freeze, --clipboard, --compare, "
+			"--skip-unchanged, --from-dump or multiple displays\n");
+		return EXIT_FAILURE;
+	}
+
+	if (tiles_dir != NULL && (output_filetype == GRIM_FILETYPE_PPM ||
+			optind < argc || handoff_target != NULL || clipboard ||
+			compare_path != NULL || n_frames > 1 || n_displays > 1)) {
+		fprintf(stderr, "--tiles can't be used with ppm, an output file, "
+			"-m, --clipboard, --compare, --frames or multiple displays\n");
+		return EXIT_FAILURE;
+	}
+
+	if ((file_options.direct || file_options.sync != OUTPUT_FILE_SYNC_NONE) &&
+			(handoff_target != NULL || clipboard || tiles_dir != NULL)) {
+		fprintf(stderr, "--direct and --sync can't be used with -m, "
+			"--clipboard or --tiles\n");
+		return EXIT_FAILURE;
+	}
+
+	if (n_bench_runs > 0 && (optind < argc || toplevel_id != NULL ||
+			detach || handoff_target != NULL || freeze || clipboard ||
+			dump_dir != NULL || from_dump_dir != NULL || state_path != NULL ||
+			compare_path != NULL || n_frames > 1 || tiles_dir != NULL ||
+			file_options.direct || file_options.sync != OUTPUT_FILE_SYNC_NONE ||
+			n_displays > 1)) {
+		fprintf(stderr, "--bench can't be used with an output file, -T, -d, "
+			"-m, --freeze, --clipboard, --dump, --from-dump, "
+			"--skip-unchanged, --compare, --frames, --tiles, --direct, "
+			"--sync or multiple displays\n");
+		return EXIT_FAILURE;
+	}
+
+	if (toplevel_id != NULL && (geometry != NULL || geometry_from_stdin ||
+			geometry_output != NULL || !use_greatest_scale ||
+			handoff_target != NULL || freeze || dump_dir != NULL ||
+			from_dump_dir != NULL || n_frames > 1 || n_displays > 1)) {
+		fprintf(stderr, "-T can't be used with -g, -o, -s, -m, --freeze, "
+			"--dump, --from-dump, --frames or multiple displays\n");
+		return EXIT_FAILURE;
+	}
+
 	const char *output_filename;
 	char *output_filepath;
 	char tmp[64];
@@ -454,175 +835,370 @@ int main(int argc, char *argv[]) {
 		output_filepath = strdup(output_filename);
 	}
 
-	struct grim_state state = {0};
-	wl_list_init(&state.outputs);
-
-	state.display = wl_display_connect(NULL);
-	if (state.display == NULL) {
-		fprintf(stderr, "failed to create display\n");
+	struct grim_encode_options encode_options;
+	grim_init_encode_options(&encode_options, output_filetype);
+	encode_options.quality = output_filetype == GRIM_FILETYPE_JPEG ?
+		jpeg_quality : webp_quality;
+	encode_options.level = output_filetype == GRIM_FILETYPE_PNG ?
+		png_level : webp_level;
+	encode_options.deadline_ms = deadline_ms;
+
+	if (compare_path != NULL && (handoff_target != NULL || clipboard ||
+			n_displays > 1)) {
+		fprintf(stderr, "--compare can't be used with -m, --clipboard or "
+			"multiple displays\n");
 		return EXIT_FAILURE;
 	}
 
-	state.registry = wl_display_get_registry(state.display);
-	wl_registry_add_listener(state.registry, &registry_listener, &state);
-	wl_display_roundtrip(state.display);
-
-	if (state.shm == NULL) {
-		fprintf(stderr, "compositor doesn't support wl_shm\n");
-		return EXIT_FAILURE;
-	}
-	if (wl_list_empty(&state.outputs)) {
-		fprintf(stderr, "no wl_output\n");
+	if (from_dump_dir != NULL && (n_displays > 1 || freeze)) {
+		fprintf(stderr, "--from-dump can't be used with several displays "
+			"or --freeze\n");
 		return EXIT_FAILURE;
 	}
 
-	if (state.xdg_output_manager != NULL) {
-		struct grim_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			output->xdg_output = zxdg_output_manager_v1_get_xdg_output(
-				state.xdg_output_manager, output->wl_output);
-			zxdg_output_v1_add_listener(output->xdg_output,
-				&xdg_output_listener, output);
+	if (n_displays > 1) {
+		if (strcmp(output_filename, "-") == 0 || detach ||
+				handoff_target != NULL || dump_dir != NULL ||
+				state_path != NULL) {
+			fprintf(stderr, "multiple displays can only be written to files\n");
+			return EXIT_FAILURE;
+		}
+		if (geometry_from_stdin) {
+			geometry = read_geometry(stdin);
+			if (geometry == NULL) {
+				return EXIT_FAILURE;
+			}
 		}
 
-		wl_display_roundtrip(state.display);
-	} else {
-		fprintf(stderr, "warning: zxdg_output_manager_v1 isn't available, "
-			"guessing the output layout\n");
-
-		struct grim_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			guess_output_logical_geometry(output);
+		struct displays_config config = {
+			.geometry = geometry,
+			.output_name = geometry_output,
+			.scale = use_greatest_scale ? 0 : scale,
+			.with_cursor = with_cursor,
+			.scale_quality = scale_quality,
+			.encode_options = encode_options,
+			.file_options = file_options,
+			.path = output_filepath,
+		};
+		bool ok = capture_displays(display_names, n_displays, &config);
+		for (size_t i = 0; i < n_displays; i++) {
+			free(display_names[i]);
 		}
+		free(display_names);
+		free(output_filepath);
+		free(geometry);
+		free(geometry_output);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	if (state.screencopy_manager == NULL) {
-		fprintf(stderr, "compositor doesn't support wlr-screencopy-unstable-v1\n");
+	char *display_name = n_displays > 0 ? display_names[0] : NULL;
+	free(display_names);
+	bool from_dump = from_dump_dir != NULL;
+	struct grim_state *state;
+	if (from_dump) {
+		state = grim_load_dump(from_dump_dir);
+		free(from_dump_dir);
+	} else {
+		state = grim_connect(display_name);
+	}
+	if (state == NULL) {
 		return EXIT_FAILURE;
 	}
+	grim_set_scale_quality(state, scale_quality);
 
-	if (geometry_output != NULL) {
-		struct grim_output *output;
-		wl_list_for_each(output, &state.outputs, link) {
-			if (output->name != NULL &&
-					strcmp(output->name, geometry_output) == 0) {
-				geometry = calloc(1, sizeof(struct grim_box));
-				memcpy(geometry, &output->logical_geometry,
-					sizeof(struct grim_box));
-			}
+	if (freeze) {
+		if (!grim_capture(state, NULL, with_cursor)) {
+			return EXIT_FAILURE;
 		}
+	}
 
+	if (geometry_from_stdin) {
+		// Have the layout ready by the time the selection is done
+		if (!grim_wait_for_layout(state)) {
+			return EXIT_FAILURE;
+		}
+		geometry = read_geometry(stdin);
 		if (geometry == NULL) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (geometry_output != NULL) {
+		struct grim_output *output = grim_find_output(state, geometry_output);
+		if (output == NULL) {
 			fprintf(stderr, "unknown output '%s'", geometry_output);
 			return EXIT_FAILURE;
 		}
+		geometry = calloc(1, sizeof(struct grim_box));
+		grim_output_get_logical_geometry(output, geometry);
 	}
 
-	size_t n_pending = 0;
-	struct grim_output *output;
-	wl_list_for_each(output, &state.outputs, link) {
-		if (geometry != NULL &&
-				!intersect_box(geometry, &output->logical_geometry)) {
-			continue;
+	pixman_image_t *image = NULL;
+	if (toplevel_id != NULL) {
+		// Windows aren't part of the layout: the image has the size of
+		// the window's buffer, in which masks are given
+		image = grim_capture_toplevel(state, toplevel_id, with_cursor);
+		free(toplevel_id);
+		if (image == NULL) {
+			return EXIT_FAILURE;
+		}
+		geometry = calloc(1, sizeof(struct grim_box));
+		*geometry = (struct grim_box){
+			.width = pixman_image_get_width(image),
+			.height = pixman_image_get_height(image),
+		};
+		use_greatest_scale = false;
+	}
+
+	bool captured = freeze || from_dump || image != NULL;
+	if (!captured && !grim_capture(state, geometry, with_cursor)) {
+		return EXIT_FAILURE;
+	}
+
+	if (dump_dir != NULL) {
+		bool ok = grim_dump(state, dump_dir);
+		free(dump_dir);
+		if (!ok) {
+			return EXIT_FAILURE;
 		}
-		if (use_greatest_scale && output->logical_scale > scale) {
-			scale = output->logical_scale;
+	}
+
+	// Output scales arrive along with the layout, which full captures
+	// don't wait for
+	if (use_greatest_scale) {
+		double greatest_scale = grim_get_greatest_scale(state, geometry);
+		if (greatest_scale > scale) {
+			scale = greatest_scale;
 		}
+	}
 
-		output->screencopy_frame = zwlr_screencopy_manager_v1_capture_output(
-			state.screencopy_manager, with_cursor, output->wl_output);
-		zwlr_screencopy_frame_v1_add_listener(output->screencopy_frame,
-			&screencopy_frame_listener, output);
+	if (geometry == NULL) {
+		geometry = calloc(1, sizeof(struct grim_box));
+		grim_get_layout_extents(state, geometry);
+	}
 
-		++n_pending;
+	if (n_bench_runs > 0) {
+		// The first capture above warms up the connection and buffers,
+		// and isn't measured
+		struct bench_options bench_options = {
+			.geometry = geometry,
+			.scale = scale,
+			.with_cursor = with_cursor,
+			.encode_options = &encode_options,
+			.n_runs = n_bench_runs,
+		};
+		bool ok = run_bench(state, &bench_options);
+		grim_disconnect(state);
+		free(display_name);
+		free(output_filepath);
+		free(geometry);
+		free(geometry_output);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	if (n_pending == 0) {
-		fprintf(stderr, "supplied geometry did not intersect with any outputs\n");
-		return EXIT_FAILURE;
+	if (handoff_target != NULL) {
+		bool ok = handoff_image(state, geometry, scale, handoff_target);
+		grim_disconnect(state);
+		free(display_name);
+		free(output_filepath);
+		free(geometry);
+		free(geometry_output);
+		free(handoff_target);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	bool done = false;
-	while (!done && wl_display_dispatch(state.display) != -1) {
-		done = (state.n_done == n_pending);
+	// Images too large to be held at once are rendered band by band while
+	// being encoded, straight from the captured frames
+	bool banded = !clipboard && image == NULL &&
+		grim_render_needs_bands(geometry, scale, memory_budget);
+
+	if (banded && (state_path != NULL || compare_path != NULL ||
+			n_frames > 1 || tiles_dir != NULL)) {
+		fprintf(stderr, "--skip-unchanged, --compare, --frames and --tiles "
+			"need the whole image in memory, raise --memory-budget\n");
+		return EXIT_FAILURE;
 	}
-	if (!done) {
-		fprintf(stderr, "failed to screenshoot all outputs\n");
+
+	// A PPM file holds the pixels as they are: they are rendered straight
+	// into the mapped file, instead of being converted and copied over
+	int32_t render_width = 0, render_height = 0;
+	if (output_filetype == GRIM_FILETYPE_PPM && !banded && image == NULL &&
+			!clipboard && !detach && state_path == NULL &&
+			compare_path == NULL && !file_options.direct &&
+			strcmp(output_filename, "-") != 0 &&
+			!grim_get_render_size(geometry, scale, &render_width,
+				&render_height)) {
 		return EXIT_FAILURE;
 	}
+	struct output_map *map = NULL;
+	pixman_image_t *mapped_image = NULL;
+	if (render_width > 0 && output_map_ppm_supported(render_width)) {
+		map = output_map_ppm(output_filepath, render_width, render_height,
+			&mapped_image);
+	}
+	if (map != NULL) {
+		bool ok = grim_render_to_image(state, geometry, scale, mapped_image);
+		pixman_image_unref(mapped_image);
+		if (!output_map_close(map, file_options.sync)) {
+			ok = false;
+		}
+		if (!ok) {
+			// Don't leave a partly rendered image behind
+			unlink(output_filepath);
+		}
+		grim_disconnect(state);
+		free(display_name);
+		free(output_filepath);
+		free(geometry);
+		free(geometry_output);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
 
-	if (geometry == NULL) {
-		geometry = calloc(1, sizeof(struct grim_box));
-		get_output_layout_extents(&state, geometry);
+	if (!banded && image == NULL) {
+		image = grim_render(state, geometry, scale);
+		if (image == NULL) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Checked before the output file is opened, which would truncate it
+	uint64_t image_hash = 0;
+	if (state_path != NULL) {
+		image_hash = hash_image(image);
+		uint64_t prev_hash;
+		if (read_state_file(state_path, &prev_hash) &&
+				prev_hash == image_hash) {
+			grim_disconnect(state);
+			pixman_image_unref(image);
+			return EXIT_UNCHANGED;
+		}
+	}
+
+	int exit_status = EXIT_SUCCESS;
+	if (compare_path != NULL) {
+		// Nothing is written if the images match, otherwise the diff
+		// is written instead of the image
+		pixman_image_t *diff = NULL;
+		int ret = compare_image(image, geometry, scale, compare_path,
+			tolerance, masks, n_masks,
+			strcmp(output_filename, "-") == 0 ? stderr : stdout, &diff);
+		free(compare_path);
+		free(masks);
+		if (diff == NULL) {
+			grim_disconnect(state);
+			pixman_image_unref(image);
+			if (ret < 0) {
+				return EXIT_FAILURE;
+			}
+			return ret == 0 ? EXIT_SUCCESS : EXIT_MISMATCH;
+		}
+		pixman_image_unref(image);
+		image = diff;
+		exit_status = EXIT_MISMATCH;
 	}
 
-	pixman_image_t *image = render(&state, geometry, scale);
-	if (image == NULL) {
+	if (clipboard) {
+		// The clipboard has its own connection, which outlives this one
+		grim_disconnect(state);
+		struct grim_clipboard *clip =
+			clipboard_offer(display_name, image, &encode_options);
+		pixman_image_unref(image);
+		free(display_name);
+		free(output_filepath);
+		free(geometry);
+		free(geometry_output);
+		if (clip == NULL) {
+			return EXIT_FAILURE;
+		}
+		if (state_path != NULL &&
+				!write_state_file(state_path, image_hash)) {
+			clipboard_destroy(clip);
+			return EXIT_FAILURE;
+		}
+		free(state_path);
+		// The selection is set by now, pasting works once we return
+		if (!detach_process()) {
+			clipboard_destroy(clip);
+			return EXIT_FAILURE;
+		}
+		bool ok = clipboard_serve(clip);
+		clipboard_destroy(clip);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	free(display_name);
+
+	if (tiles_dir != NULL) {
+		grim_disconnect(state);
+		free(output_filepath);
+		free(geometry);
+		free(geometry_output);
+		if (detach && !detach_process()) {
+			return EXIT_FAILURE;
+		}
+		bool ok = write_tiles(image, tiles_dir, &encode_options);
+		pixman_image_unref(image);
+		free(tiles_dir);
+		if (ok && state_path != NULL &&
+				!write_state_file(state_path, image_hash)) {
+			ok = false;
+		}
+		free(state_path);
+		return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
+	struct output_file *file = output_file_open(output_filepath,
+		&file_options);
+	if (file == NULL) {
 		return EXIT_FAILURE;
 	}
 
-	FILE *file;
-	if (strcmp(output_filename, "-") == 0) {
-		file = stdout;
-	} else {
-		file = fopen(output_filepath, "w");
-		if (!file) {
-			fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
-				output_filepath, strerror(errno));
+	bool disconnected = false;
+	if (detach) {
+		// All pixels have been copied into the image: let the compositor
+		// go and return control to the caller before encoding. Bands are
+		// still to be rendered from the frames, which are kept.
+		if (!banded) {
+			grim_disconnect(state);
+			disconnected = true;
+		}
+		if (!detach_process()) {
 			return EXIT_FAILURE;
 		}
 	}
 
-	int ret = 0;
-	switch (output_filetype) {
-	case GRIM_FILETYPE_PPM:
-		ret = write_to_ppm_stream(image, file);
-		break;
-	case GRIM_FILETYPE_PNG:
-		ret = write_to_png_stream(image, file, png_level);
-		break;
-	case GRIM_FILETYPE_JPEG:
-#if HAVE_JPEG
-		ret = write_to_jpeg_stream(image, file, jpeg_quality);
-		break;
-#else
-		abort();
-#endif
+	int ret;
+	if (n_frames > 1) {
+		ret = capture_animation(state, geometry, scale, with_cursor, image,
+			n_frames, interval_ms, &encode_options, file) ? 0 : -1;
+	} else if (banded) {
+		ret = grim_render_encode(state, geometry, scale, memory_budget,
+			&encode_options, output_file_write, file);
+	} else {
+		ret = grim_encode(image, &encode_options, output_file_write, file);
+	}
+	// Always called, to flush and close the file
+	if (!output_file_close(file)) {
+		ret = -1;
 	}
 	if (ret == -1) {
 		// Error messages will be printed at the source
 		return EXIT_FAILURE;
 	}
 
-	if (strcmp(output_filename, "-") != 0) {
-		fclose(file);
+	// Only once the image is written, so that a failed run is retried
+	if (state_path != NULL && !write_state_file(state_path, image_hash)) {
+		return EXIT_FAILURE;
 	}
-
+	free(state_path);
 	free(output_filepath);
-	pixman_image_unref(image);
-
-	struct grim_output *output_tmp;
-	wl_list_for_each_safe(output, output_tmp, &state.outputs, link) {
-		wl_list_remove(&output->link);
-		free(output->name);
-		if (output->screencopy_frame != NULL) {
-			zwlr_screencopy_frame_v1_destroy(output->screencopy_frame);
-		}
-		destroy_buffer(output->buffer);
-		if (output->xdg_output != NULL) {
-			zxdg_output_v1_destroy(output->xdg_output);
-		}
-		wl_output_release(output->wl_output);
-		free(output);
+	if (image != NULL) {
+		pixman_image_unref(image);
 	}
-	zwlr_screencopy_manager_v1_destroy(state.screencopy_manager);
-	if (state.xdg_output_manager != NULL) {
-		zxdg_output_manager_v1_destroy(state.xdg_output_manager);
+
+	if (!disconnected) {
+		grim_disconnect(state);
 	}
-	wl_shm_destroy(state.shm);
-	wl_registry_destroy(state.registry);
-	wl_display_disconnect(state.display);
 	free(geometry);
 	free(geometry_output);
-	return EXIT_SUCCESS;
+	return exit_status;
 }
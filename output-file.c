@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#include "output-file.h"
+
+// Large enough for few system calls, small enough for the encoder to get
+// going again while the previous buffers are written
+#define BUFFER_SIZE (1 << 20)
+#define N_BUFFERS 4
+// O_DIRECT wants buffers, lengths and offsets aligned to the logical block
+// size, which this covers
+#define DIRECT_ALIGN 4096
+
+struct output_buffer {
+	uint8_t *data;
+	size_t len;
+	off_t offset;
+	bool in_flight;
+};
+
+struct output_file {
+	int fd;
+	bool is_stdout;
+	// Pipes, character devices and the standard output have no offsets
+	bool is_stream;
+	bool direct;
+	enum output_file_sync sync;
+	bool failed;
+	off_t offset; // of the current buffer
+	struct output_buffer buffers[N_BUFFERS];
+	size_t current;
+#ifdef HAVE_LIBURING
+	bool has_ring;
+	struct io_uring ring;
+	size_t n_in_flight;
+#endif
+};
+
+static bool write_all(int fd, const uint8_t *buf, size_t len, off_t offset,
+		bool positioned) {
+	while (len > 0) {
+		ssize_t n = positioned ? pwrite(fd, buf, len, offset) :
+			write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+static void buffer_written(struct output_file *file,
+		struct output_buffer *buffer) {
+	if (file->sync == OUTPUT_FILE_SYNC_RANGE && !file->is_stream) {
+		// Only starts the writeback, the final fdatasync() waits for it
+		sync_file_range(file->fd, buffer->offset, buffer->len,
+			SYNC_FILE_RANGE_WRITE);
+	}
+	buffer->in_flight = false;
+	buffer->len = 0;
+}
+
+#ifdef HAVE_LIBURING
+// Waits for one write to complete
+static void reap_write(struct output_file *file) {
+	struct io_uring_cqe *cqe;
+	int ret;
+	while ((ret = io_uring_wait_cqe(&file->ring, &cqe)) == -EINTR) {
+		// Keep waiting
+	}
+	if (ret < 0) {
+		fprintf(stderr, "failed to wait for write: %s\n", strerror(-ret));
+		file->failed = true;
+		// Nothing can be known about the writes left
+		file->n_in_flight = 0;
+		for (size_t i = 0; i < N_BUFFERS; i++) {
+			file->buffers[i].in_flight = false;
+		}
+		return;
+	}
+
+	struct output_buffer *buffer = io_uring_cqe_get_data(cqe);
+	int res = cqe->res;
+	io_uring_cqe_seen(&file->ring, cqe);
+	--file->n_in_flight;
+
+	if (res < 0) {
+		fprintf(stderr, "failed to write: %s\n", strerror(-res));
+		file->failed = true;
+	} else if ((size_t)res < buffer->len && !write_all(file->fd,
+			buffer->data + res, buffer->len - res, buffer->offset + res,
+			true)) {
+		// Short writes are rare enough to be finished synchronously
+		fprintf(stderr, "failed to write: %s\n", strerror(errno));
+		file->failed = true;
+	}
+	buffer_written(file, buffer);
+}
+
+static bool submit_write(struct output_file *file,
+		struct output_buffer *buffer) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&file->ring);
+	if (sqe == NULL) {
+		return false;
+	}
+	io_uring_prep_write(sqe, file->fd, buffer->data, buffer->len,
+		buffer->offset);
+	io_uring_sqe_set_data(sqe, buffer);
+	if (io_uring_submit(&file->ring) < 0) {
+		return false;
+	}
+	buffer->in_flight = true;
+	++file->n_in_flight;
+	return true;
+}
+#endif
+
+#ifdef HAVE_LIBURING
+static void reap_all_writes(struct output_file *file) {
+	while (file->n_in_flight > 0) {
+		reap_write(file);
+	}
+}
+#endif
+
+// Hands the current buffer over for writing and moves to the next one. Only
+// the last buffer may have a length unaligned for O_DIRECT.
+static void flush_buffer(struct output_file *file) {
+	struct output_buffer *buffer = &file->buffers[file->current];
+	if (buffer->len == 0) {
+		return;
+	}
+	buffer->offset = file->offset;
+	file->offset += buffer->len;
+
+	if (file->direct && buffer->len % DIRECT_ALIGN != 0) {
+		// The tail can't be written with O_DIRECT. Writes already
+		// queued are finished first, so that the flag doesn't change
+		// under them.
+#ifdef HAVE_LIBURING
+		reap_all_writes(file);
+#endif
+		int flags = fcntl(file->fd, F_GETFL);
+		if (flags < 0 || fcntl(file->fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+			fprintf(stderr, "failed to disable O_DIRECT: %s\n",
+				strerror(errno));
+			file->failed = true;
+		}
+		file->direct = false;
+	}
+
+	bool submitted = false;
+#ifdef HAVE_LIBURING
+	submitted = file->has_ring && submit_write(file, buffer);
+#endif
+	if (!submitted) {
+		if (!write_all(file->fd, buffer->data, buffer->len, buffer->offset,
+				!file->is_stream)) {
+			fprintf(stderr, "failed to write: %s\n", strerror(errno));
+			file->failed = true;
+		}
+		buffer_written(file, buffer);
+	}
+
+	file->current = (file->current + 1) % N_BUFFERS;
+#ifdef HAVE_LIBURING
+	// The next buffer is filled once its previous write is done
+	while (file->buffers[file->current].in_flight) {
+		reap_write(file);
+	}
+#endif
+}
+
+int output_file_write(void *data, const void *buf, size_t len) {
+	struct output_file *file = data;
+	const uint8_t *src = buf;
+	while (len > 0 && !file->failed) {
+		struct output_buffer *buffer = &file->buffers[file->current];
+		size_t n = BUFFER_SIZE - buffer->len;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(buffer->data + buffer->len, src, n);
+		buffer->len += n;
+		src += n;
+		len -= n;
+		if (buffer->len == BUFFER_SIZE) {
+			flush_buffer(file);
+		}
+	}
+	return file->failed ? -1 : 0;
+}
+
+static int open_file(const char *path, bool *direct) {
+	int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	if (*direct) {
+		int fd = open(path, flags | O_DIRECT, 0666);
+		if (fd >= 0 || errno != EINVAL) {
+			return fd;
+		}
+		fprintf(stderr, "warning: O_DIRECT isn't supported for '%s'\n",
+			path);
+		*direct = false;
+	}
+	return open(path, flags, 0666);
+}
+
+static void free_output_file(struct output_file *file) {
+	for (size_t i = 0; i < N_BUFFERS; i++) {
+		free(file->buffers[i].data);
+	}
+	free(file);
+}
+
+struct output_file *output_file_open(const char *path,
+		const struct output_file_options *options) {
+	struct output_file *file = calloc(1, sizeof(struct output_file));
+	if (file == NULL) {
+		fprintf(stderr, "failed to allocate output file\n");
+		return NULL;
+	}
+	file->sync = options->sync;
+	for (size_t i = 0; i < N_BUFFERS; i++) {
+		// Aligned for O_DIRECT, harmless otherwise
+		if (posix_memalign((void **)&file->buffers[i].data, DIRECT_ALIGN,
+				BUFFER_SIZE) != 0) {
+			fprintf(stderr, "failed to allocate output buffers\n");
+			free_output_file(file);
+			return NULL;
+		}
+	}
+
+	if (strcmp(path, "-") == 0) {
+		file->fd = STDOUT_FILENO;
+		file->is_stdout = true;
+		file->is_stream = true;
+		return file;
+	}
+
+	file->direct = options->direct;
+	file->fd = open_file(path, &file->direct);
+	if (file->fd < 0) {
+		fprintf(stderr, "Failed to open file '%s' for writing: %s\n",
+			path, strerror(errno));
+		free_output_file(file);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(file->fd, &st) == 0 && !S_ISREG(st.st_mode)) {
+		// Written in order with plain write(), O_DIRECT makes no sense
+		// there either
+		file->is_stream = true;
+		if (file->direct) {
+			int flags = fcntl(file->fd, F_GETFL);
+			if (flags >= 0) {
+				fcntl(file->fd, F_SETFL, flags & ~O_DIRECT);
+			}
+			file->direct = false;
+		}
+		return file;
+	}
+
+#ifdef HAVE_LIBURING
+	// Falls back to plain writes where io_uring is missing or forbidden
+	file->has_ring = io_uring_queue_init(N_BUFFERS, &file->ring, 0) == 0;
+#endif
+	return file;
+}
+
+bool output_file_close(struct output_file *file) {
+	if (!file->failed) {
+		flush_buffer(file);
+	}
+#ifdef HAVE_LIBURING
+	if (file->has_ring) {
+		reap_all_writes(file);
+		io_uring_queue_exit(&file->ring);
+	}
+#endif
+
+	bool ok = !file->failed;
+	if (ok && !file->is_stream && file->sync != OUTPUT_FILE_SYNC_NONE &&
+			fdatasync(file->fd) != 0) {
+		fprintf(stderr, "failed to sync: %s\n", strerror(errno));
+		ok = false;
+	}
+	if (!file->is_stdout && close(file->fd) != 0) {
+		fprintf(stderr, "failed to close: %s\n", strerror(errno));
+		ok = false;
+	}
+	free_output_file(file);
+	return ok;
+}
+
+struct output_map {
+	int fd;
+	void *data;
+	size_t size;
+};
+
+bool output_map_ppm_supported(int32_t width) {
+	return width % 4 == 0;
+}
+
+struct output_map *output_map_ppm(const char *path, int32_t width,
+		int32_t height, pixman_image_t **image) {
+	assert(output_map_ppm_supported(width));
+
+	// The pixels must start on a 32-bit boundary too: a comment pads the
+	// header, "#\n" being the shortest one
+	char header[64];
+	int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n",
+		width, height);
+	int pad = (4 - header_len % 4) % 4;
+	if (pad == 1) {
+		pad += 4;
+	}
+	if (pad > 0) {
+		header_len = snprintf(header, sizeof(header), "P6\n#%*s\n%d %d\n255\n",
+			pad - 2, "", width, height);
+	}
+	assert(header_len % 4 == 0 && header_len < (int)sizeof(header));
+
+	// Checked before opening: opening a FIFO and closing it again would
+	// end the stream for its reader
+	struct stat st;
+	if (stat(path, &st) == 0 && !S_ISREG(st.st_mode)) {
+		return NULL;
+	}
+
+	struct output_map *map = calloc(1, sizeof(struct output_map));
+	if (map == NULL) {
+		fprintf(stderr, "failed to allocate output map\n");
+		return NULL;
+	}
+	size_t stride = (size_t)width * 3;
+	map->size = header_len + stride * height;
+
+	// Errors are left for the usual path to report
+	map->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (map->fd < 0) {
+		free(map);
+		return NULL;
+	}
+	// The file reads back as black where no output covers the image, like
+	// a cleared a8r8g8b8 image. Its blocks are reserved up front: running
+	// out of space while rendering into the mapping would be a SIGBUS.
+	if (ftruncate(map->fd, map->size) != 0 ||
+			posix_fallocate(map->fd, 0, map->size) != 0) {
+		goto error_fd;
+	}
+	map->data = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		map->fd, 0);
+	if (map->data == MAP_FAILED) {
+		goto error_fd;
+	}
+	memcpy(map->data, header, header_len);
+
+	// pixman stores 24-bit pixels in native byte order, and PPM wants
+	// them as R, G, B bytes
+#if GRIM_LITTLE_ENDIAN
+	pixman_format_code_t format = PIXMAN_b8g8r8;
+#else
+	pixman_format_code_t format = PIXMAN_r8g8b8;
+#endif
+	*image = pixman_image_create_bits(format, width, height,
+		(uint32_t *)((uint8_t *)map->data + header_len), stride);
+	if (*image == NULL) {
+		fprintf(stderr, "Failed to create image\n");
+		munmap(map->data, map->size);
+		goto error_fd;
+	}
+	return map;
+
+error_fd:
+	close(map->fd);
+	free(map);
+	return NULL;
+}
+
+bool output_map_close(struct output_map *map, enum output_file_sync sync) {
+	bool ok = true;
+	// Pixels were written through the mapping, there is nothing to write
+	// back range by range
+	if (sync != OUTPUT_FILE_SYNC_NONE &&
+			(msync(map->data, map->size, MS_SYNC) != 0 ||
+			fdatasync(map->fd) != 0)) {
+		fprintf(stderr, "failed to sync: %s\n", strerror(errno));
+		ok = false;
+	}
+	munmap(map->data, map->size);
+	if (close(map->fd) != 0) {
+		fprintf(stderr, "failed to close: %s\n", strerror(errno));
+		ok = false;
+	}
+	free(map);
+	return ok;
+}
@@ -1,16 +1,39 @@
 #define _XOPEN_SOURCE 500
 #include <limits.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "output-layout.h"
 #include "grim.h"
 
-void get_output_layout_extents(struct grim_state *state, struct grim_box *box) {
+static int compare_output_x(const void *a, const void *b) {
+	const struct grim_output *output_a = *(struct grim_output *const *)a;
+	const struct grim_output *output_b = *(struct grim_output *const *)b;
+	int32_t x_a = output_a->logical_geometry.x;
+	int32_t x_b = output_b->logical_geometry.x;
+	return (x_a > x_b) - (x_a < x_b);
+}
+
+void build_output_layout(struct grim_state *state) {
+	struct grim_output_layout *layout = &state->layout;
+	finish_output_layout(state);
+
+	size_t n_outputs = wl_list_length(&state->outputs);
+	layout->outputs = calloc(n_outputs, sizeof(struct grim_output *));
+	if (layout->outputs == NULL) {
+		return;
+	}
+
 	int32_t x1 = INT_MAX, y1 = INT_MAX;
 	int32_t x2 = INT_MIN, y2 = INT_MIN;
 
 	struct grim_output *output;
 	wl_list_for_each(output, &state->outputs, link) {
+		layout->outputs[layout->n_outputs++] = output;
+		output->overlapping = false;
+
 		if (output->logical_geometry.x < x1) {
 			x1 = output->logical_geometry.x;
 		}
@@ -25,10 +48,97 @@ void get_output_layout_extents(struct grim_state *state, struct grim_box *box) {
 		}
 	}
 
-	box->x = x1;
-	box->y = y1;
-	box->width = x2 - x1;
-	box->height = y2 - y1;
+	layout->extents = (struct grim_box){
+		.x = x1,
+		.y = y1,
+		.width = x2 - x1,
+		.height = y2 - y1,
+	};
+
+	// Sweep over the outputs sorted by x: only those whose x ranges
+	// intersect need to be compared, which keeps the work close to linear
+	// for the usual side-by-side layouts and video walls
+	qsort(layout->outputs, layout->n_outputs, sizeof(struct grim_output *),
+		compare_output_x);
+	for (size_t i = 0; i < layout->n_outputs; i++) {
+		struct grim_output *a = layout->outputs[i];
+		for (size_t j = i + 1; j < layout->n_outputs; j++) {
+			struct grim_output *b = layout->outputs[j];
+			if (b->logical_geometry.x >=
+					a->logical_geometry.x + a->logical_geometry.width) {
+				break;
+			}
+			if (intersect_box(&a->logical_geometry, &b->logical_geometry)) {
+				a->overlapping = true;
+				b->overlapping = true;
+			}
+		}
+	}
+}
+
+static bool output_info_done(struct grim_output *output) {
+	if (output->xdg_output != NULL) {
+		return output->xdg_output_done;
+	}
+	return output->wl_output_done;
+}
+
+bool try_output_layout(struct grim_state *state) {
+	if (state->layout_ready) {
+		return true;
+	}
+
+	struct grim_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output_info_done(output)) {
+			return false;
+		}
+	}
+
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->xdg_output == NULL) {
+			guess_output_logical_geometry(output);
+		}
+	}
+	build_output_layout(state);
+	state->layout_ready = true;
+	return true;
+}
+
+bool ensure_output_layout(struct grim_state *state) {
+	while (!try_output_layout(state)) {
+		if (wl_display_dispatch(state->display) == -1) {
+			fprintf(stderr, "failed to get the output layout\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+void finish_output_layout(struct grim_state *state) {
+	free(state->layout.outputs);
+	state->layout = (struct grim_output_layout){0};
+}
+
+size_t find_outputs_in_box(struct grim_state *state, struct grim_box *box,
+		struct grim_output **outputs) {
+	struct grim_output_layout *layout = &state->layout;
+	size_t n = 0;
+	for (size_t i = 0; i < layout->n_outputs; i++) {
+		struct grim_output *output = layout->outputs[i];
+		if (output->logical_geometry.x >= box->x + box->width) {
+			// All remaining outputs are further right
+			break;
+		}
+		if (intersect_box(box, &output->logical_geometry)) {
+			outputs[n++] = output;
+		}
+	}
+	return n;
+}
+
+void get_output_layout_extents(struct grim_state *state, struct grim_box *box) {
+	*box = state->layout.extents;
 }
 
 void apply_output_transform(enum wl_output_transform transform,
@@ -66,3 +176,77 @@ void guess_output_logical_geometry(struct grim_output *output) {
 		&output->logical_geometry.height);
 	output->logical_scale = output->scale;
 }
+
+bool grim_wait_for_layout(struct grim_state *state) {
+	return ensure_output_layout(state);
+}
+
+size_t grim_get_output_count(struct grim_state *state) {
+	if (!ensure_output_layout(state)) {
+		return 0;
+	}
+	return state->layout.n_outputs;
+}
+
+struct grim_output *grim_get_output(struct grim_state *state, size_t index) {
+	if (!ensure_output_layout(state) || index >= state->layout.n_outputs) {
+		return NULL;
+	}
+	return state->layout.outputs[index];
+}
+
+struct grim_output *grim_find_output(struct grim_state *state,
+		const char *name) {
+	if (!ensure_output_layout(state)) {
+		return NULL;
+	}
+	for (size_t i = 0; i < state->layout.n_outputs; i++) {
+		struct grim_output *output = state->layout.outputs[i];
+		if (output->name != NULL && strcmp(output->name, name) == 0) {
+			return output;
+		}
+	}
+	return NULL;
+}
+
+const char *grim_output_get_name(struct grim_output *output) {
+	return output->name;
+}
+
+void grim_output_get_logical_geometry(struct grim_output *output,
+		struct grim_box *box) {
+	*box = output->logical_geometry;
+}
+
+double grim_output_get_scale(struct grim_output *output) {
+	return output->logical_scale;
+}
+
+void grim_get_layout_extents(struct grim_state *state, struct grim_box *box) {
+	if (!ensure_output_layout(state)) {
+		*box = (struct grim_box){0};
+		return;
+	}
+	get_output_layout_extents(state, box);
+}
+
+double grim_get_greatest_scale(struct grim_state *state,
+		const struct grim_box *box) {
+	double scale = 0;
+	if (!ensure_output_layout(state)) {
+		return scale;
+	}
+	for (size_t i = 0; i < state->layout.n_outputs; i++) {
+		struct grim_output *output = state->layout.outputs[i];
+		if (box != NULL) {
+			struct grim_box geometry = *box;
+			if (!intersect_box(&geometry, &output->logical_geometry)) {
+				continue;
+			}
+		}
+		if (output->logical_scale > scale) {
+			scale = output->logical_scale;
+		}
+	}
+	return scale;
+}
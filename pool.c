@@ -0,0 +1,112 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+struct pool_task {
+	pool_task_func func;
+	void *data;
+	struct pool_task *next;
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct pool_task *head, *tail;
+	bool stopping;
+
+	pthread_t *threads;
+	size_t n_threads;
+};
+
+static void *pool_run(void *data) {
+	struct pool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->head == NULL && !pool->stopping) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		struct pool_task *task = pool->head;
+		if (task == NULL) {
+			break;
+		}
+		pool->head = task->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+		task->func(task->data);
+		free(task);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct pool *pool_create(size_t n_threads) {
+	struct pool *pool = calloc(1, sizeof(struct pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->threads = calloc(n_threads, sizeof(pthread_t));
+	if (pool->threads == NULL && n_threads > 0) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (size_t i = 0; i < n_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, pool_run, pool) != 0) {
+			fprintf(stderr, "failed to start worker thread\n");
+			break;
+		}
+		++pool->n_threads;
+	}
+	return pool;
+}
+
+bool pool_submit(struct pool *pool, pool_task_func func, void *data) {
+	if (pool->n_threads == 0) {
+		func(data);
+		return true;
+	}
+
+	struct pool_task *task = calloc(1, sizeof(struct pool_task));
+	if (task == NULL) {
+		return false;
+	}
+	task->func = func;
+	task->data = data;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail != NULL) {
+		pool->tail->next = task;
+	} else {
+		pool->head = task;
+	}
+	pool->tail = task;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	return true;
+}
+
+void pool_finish(struct pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < pool->n_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
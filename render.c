@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -6,10 +7,14 @@
 #include <pixman.h>
 
 #include "buffer.h"
+#include "downscale.h"
+#include "grim.h"
 #include "output-layout.h"
+#include "probes.h"
 #include "render.h"
+#include "rotate.h"
 
-static pixman_format_code_t get_pixman_format(enum wl_shm_format wl_fmt) {
+pixman_format_code_t get_pixman_format(enum wl_shm_format wl_fmt) {
 	switch (wl_fmt) {
 #if GRIM_LITTLE_ENDIAN
 	case WL_SHM_FORMAT_RGB332:
@@ -87,9 +92,11 @@ static pixman_format_code_t get_pixman_format(enum wl_shm_format wl_fmt) {
 	}
 }
 
+// Computes the region of the common image touched by the output, and the
+// interior of that region made of pixels fully covered by the output
 static void compute_composite_region(const struct pixman_f_transform *out2com,
 		int output_width, int output_height, struct grim_box *dest,
-		bool *grid_aligned) {
+		struct grim_box *interior, bool *grid_aligned) {
 	struct pixman_transform o2c_fixedpt;
 	pixman_transform_from_pixman_f_transform(&o2c_fixedpt, out2com);
 
@@ -127,14 +134,111 @@ static void compute_composite_region(const struct pixman_f_transform *out2com,
 		.width = x2 - x1,
 		.height = y2 - y1
 	};
+
+	int32_t ix1 = pixman_fixed_to_int(pixman_fixed_ceil(x_min));
+	int32_t ix2 = pixman_fixed_to_int(pixman_fixed_floor(x_max));
+	int32_t iy1 = pixman_fixed_to_int(pixman_fixed_ceil(y_min));
+	int32_t iy2 = pixman_fixed_to_int(pixman_fixed_floor(y_max));
+	*interior = (struct grim_box) {
+		.x = ix1,
+		.y = iy1,
+		.width = ix2 - ix1,
+		.height = iy2 - iy1
+	};
 }
 
-pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
-		double scale) {
-	pixman_image_t *common_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
-		geometry->width * scale, geometry->height * scale,
-		NULL, 0);
+// Cheap check in floating point, done before anything is converted to
+// fixed point, which far away outputs would overflow
+static bool is_output_visible(const struct pixman_f_transform *out2com,
+		int output_width, int output_height, pixman_image_t *image) {
+	struct pixman_f_vector corners[4] = {
+		{{0, 0, 1}},
+		{{output_width, 0, 1}},
+		{{0, output_height, 1}},
+		{{output_width, output_height, 1}},
+	};
 
+	double x_min = INFINITY, x_max = -INFINITY,
+		y_min = INFINITY, y_max = -INFINITY;
+	for (int i = 0; i < 4; i++) {
+		pixman_f_transform_point(out2com, &corners[i]);
+		x_min = fmin(x_min, corners[i].v[0]);
+		x_max = fmax(x_max, corners[i].v[0]);
+		y_min = fmin(y_min, corners[i].v[1]);
+		y_max = fmax(y_max, corners[i].v[1]);
+	}
+	return x_max > 0 && x_min < pixman_image_get_width(image) &&
+		y_max > 0 && y_min < pixman_image_get_height(image);
+}
+
+static void composite_box(pixman_op_t op, pixman_image_t *src,
+		pixman_image_t *dest, const struct grim_box *origin,
+		const struct grim_box *box) {
+	if (box->width <= 0 || box->height <= 0) {
+		return;
+	}
+	pixman_image_composite32(op, src, NULL, dest,
+		box->x - origin->x, box->y - origin->y, 0, 0,
+		box->x, box->y, box->width, box->height);
+}
+
+// Copies the interior of the region, and only blends the partially covered
+// pixels along its edges. This gives the same result as blending the whole
+// region, since nothing else draws onto the interior.
+static void composite_with_seams(pixman_image_t *src, pixman_image_t *dest,
+		const struct grim_box *region, const struct grim_box *interior) {
+	if (interior->width <= 0 || interior->height <= 0) {
+		composite_box(PIXMAN_OP_OVER, src, dest, region, region);
+		return;
+	}
+
+	int32_t region_x2 = region->x + region->width;
+	int32_t region_y2 = region->y + region->height;
+	int32_t interior_x2 = interior->x + interior->width;
+	int32_t interior_y2 = interior->y + interior->height;
+	struct grim_box seams[] = {
+		{ region->x, region->y, region->width, interior->y - region->y },
+		{ region->x, interior_y2, region->width, region_y2 - interior_y2 },
+		{ region->x, interior->y, interior->x - region->x, interior->height },
+		{ interior_x2, interior->y, region_x2 - interior_x2, interior->height },
+	};
+
+	composite_box(PIXMAN_OP_SRC, src, dest, region, interior);
+	for (size_t i = 0; i < sizeof(seams) / sizeof(seams[0]); i++) {
+		composite_box(PIXMAN_OP_OVER, src, dest, region, &seams[i]);
+	}
+}
+
+void grim_set_scale_quality(struct grim_state *state,
+		enum grim_scale_quality quality) {
+	state->scale_quality = quality;
+}
+
+bool get_render_size(const struct grim_box *geometry, double scale,
+		int32_t *width, int32_t *height) {
+	double w = geometry->width * scale;
+	double h = geometry->height * scale;
+	if (!(w >= 1 && h >= 1)) {
+		fprintf(stderr, "image would be empty\n");
+		return false;
+	}
+	if (w > INT32_MAX || h > INT32_MAX) {
+		fprintf(stderr, "image would be too large\n");
+		return false;
+	}
+	*width = w;
+	*height = h;
+	return true;
+}
+
+bool grim_get_render_size(const struct grim_box *box, double scale,
+		int32_t *width, int32_t *height) {
+	return get_render_size(box, scale, width, height);
+}
+
+bool render_tile(struct grim_state *state, const struct grim_box *geometry,
+		double scale, pixman_image_t *common_image, int32_t tile_x,
+		int32_t tile_y) {
 	struct grim_output *output;
 	wl_list_for_each(output, &state->outputs, link) {
 		struct grim_buffer *buffer = output->buffer;
@@ -146,7 +250,7 @@ pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 		if (!pixman_fmt) {
 			fprintf(stderr, "unsupported format %d = 0x%08x\n",
 				buffer->format, buffer->format);
-			return NULL;
+			return false;
 		}
 
 		int32_t output_x = output->logical_geometry.x - geometry->x;
@@ -168,7 +272,7 @@ pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 			buffer->data, buffer->stride);
 		if (!output_image) {
 			fprintf(stderr, "Failed to create image\n");
-			return NULL;
+			return false;
 		}
 
 		// The transformation `out2com` will send a pixel in the output_image
@@ -190,24 +294,56 @@ pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 			(double)output_height / 2);
 		pixman_f_transform_translate(&out2com, NULL, output_x, output_y);
 		pixman_f_transform_scale(&out2com, NULL, scale, scale);
+		pixman_f_transform_translate(&out2com, NULL, -tile_x, -tile_y);
+
+		if (!is_output_visible(&out2com, buffer->width, buffer->height,
+				common_image)) {
+			pixman_image_unref(output_image);
+			continue;
+		}
 
-		struct grim_box composite_dest;
+		struct grim_box composite_dest, composite_interior;
 		bool grid_aligned;
 		compute_composite_region(&out2com, buffer->width,
-			buffer->height, &composite_dest, &grid_aligned);
+			buffer->height, &composite_dest, &composite_interior,
+			&grid_aligned);
 
 		pixman_f_transform_translate(&out2com, NULL,
 			-composite_dest.x, -composite_dest.y);
 
+		double x_scale = fmax(fabs(out2com.m[0][0]), fabs(out2com.m[0][1]));
+		double y_scale = fmax(fabs(out2com.m[1][0]), fabs(out2com.m[1][1]));
+
+		// Most of a large downscale is done with cheap box reductions,
+		// leaving only a ratio above 0.5 to the final filter
+		int box_levels = 0;
+		if (state->scale_quality != GRIM_SCALE_QUALITY_BEST) {
+			box_levels = box_downscale_levels(pixman_fmt,
+				fmax(x_scale, y_scale));
+		}
+		if (box_levels > 0) {
+			pixman_image_t *reduced = box_downscale(output_image, box_levels);
+			pixman_image_unref(output_image);
+			if (reduced == NULL) {
+				return false;
+			}
+			output_image = reduced;
+			x_scale *= 1 << box_levels;
+			y_scale *= 1 << box_levels;
+		}
+
 		struct pixman_f_transform com2out;
 		pixman_f_transform_invert(&com2out, &out2com);
+		// A reduced pixel covers exactly 2^levels source pixels, so this is
+		// a plain scale of the pixel grid
+		pixman_f_transform_scale(&com2out, NULL,
+			1. / (1 << box_levels), 1. / (1 << box_levels));
 		struct pixman_transform c2o_fixedpt;
 		pixman_transform_from_pixman_f_transform(&c2o_fixedpt, &com2out);
 		pixman_image_set_transform(output_image, &c2o_fixedpt);
 
-		double x_scale = fmax(fabs(out2com.m[0][0]), fabs(out2com.m[0][1]));
-		double y_scale = fmax(fabs(out2com.m[1][0]), fabs(out2com.m[1][1]));
-		if (x_scale >= 0.75 && y_scale >= 0.75) {
+		if ((x_scale >= 0.75 && y_scale >= 0.75) || (box_levels > 0 &&
+				state->scale_quality == GRIM_SCALE_QUALITY_FAST)) {
 			// Bilinear scaling is relatively fast and gives decent
 			// results for upscaling and light downscaling
 			pixman_image_set_filter(output_image,
@@ -229,26 +365,119 @@ pixman_image_t *render(struct grim_state *state, struct grim_box *geometry,
 			free(conv);
 		}
 
-		bool overlapping = false;
-		struct grim_output *other_output;
-		wl_list_for_each(other_output, &state->outputs, link) {
-			if (output != other_output && intersect_box(&output->logical_geometry,
-					&other_output->logical_geometry)) {
-				overlapping = true;
-			}
-		}
 		/* OP_SRC copies the image instead of blending it, and is much
 		 * faster, but this a) is incorrect in the weird case where
 		 * logical outputs overlap and are partially transparent b)
 		 * can draw the edge between two outputs incorrectly if that
-		 * edge is not exactly grid aligned in the common image */
-		pixman_op_t op = (grid_aligned && !overlapping) ? PIXMAN_OP_SRC : PIXMAN_OP_OVER;
-		pixman_image_composite32(op, output_image, NULL, common_image,
-			0, 0, 0, 0, composite_dest.x, composite_dest.y,
-			composite_dest.width, composite_dest.height);
+		 * edge is not exactly grid aligned in the common image. In the
+		 * latter case, only the edge needs OP_OVER. */
+		pixman_op_t op = (grid_aligned && !output->overlapping) ?
+			PIXMAN_OP_SRC : PIXMAN_OP_OVER;
+		GRIM_PROBE(render_output_start, output->name, composite_dest.x,
+			composite_dest.y, composite_dest.width, composite_dest.height, op);
+		if (op == PIXMAN_OP_SRC && blit_rotated(output_image, common_image,
+				&c2o_fixedpt, &composite_dest)) {
+			// Rotated or flipped without any scaling
+		} else if (!grid_aligned && !output->overlapping) {
+			composite_with_seams(output_image, common_image,
+				&composite_dest, &composite_interior);
+		} else {
+			pixman_image_composite32(op, output_image, NULL, common_image,
+				0, 0, 0, 0, composite_dest.x, composite_dest.y,
+				composite_dest.width, composite_dest.height);
+		}
+		GRIM_PROBE(render_output_end, output->name, composite_dest.width,
+			composite_dest.height);
 
 		pixman_image_unref(output_image);
 	}
 
+	return true;
+}
+
+bool grim_render_to_image(struct grim_state *state,
+		const struct grim_box *geometry, double scale,
+		pixman_image_t *common_image) {
+	return render_tile(state, geometry, scale, common_image, 0, 0);
+}
+
+pixman_image_t *render_buffer(struct grim_buffer *buffer,
+		enum wl_output_transform transform) {
+	pixman_format_code_t pixman_fmt = get_pixman_format(buffer->format);
+	if (!pixman_fmt) {
+		fprintf(stderr, "unsupported format %d = 0x%08x\n",
+			buffer->format, buffer->format);
+		return NULL;
+	}
+
+	int32_t width = buffer->width;
+	int32_t height = buffer->height;
+	apply_output_transform(transform, &width, &height);
+
+	pixman_image_t *buffer_image = pixman_image_create_bits(pixman_fmt,
+		buffer->width, buffer->height, buffer->data, buffer->stride);
+	pixman_image_t *image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+		width, height, NULL, 0);
+	if (buffer_image == NULL || image == NULL) {
+		fprintf(stderr, "Failed to create image\n");
+		if (buffer_image != NULL) {
+			pixman_image_unref(buffer_image);
+		}
+		if (image != NULL) {
+			pixman_image_unref(image);
+		}
+		return NULL;
+	}
+
+	// Same as the transformation of outputs in render_tile(), at their
+	// own scale
+	struct pixman_f_transform buf2img;
+	pixman_f_transform_init_identity(&buf2img);
+	pixman_f_transform_translate(&buf2img, NULL,
+		-(double)buffer->width / 2, -(double)buffer->height / 2);
+	pixman_f_transform_rotate(&buf2img, NULL,
+		round(cos(get_output_rotation(transform))),
+		round(sin(get_output_rotation(transform))));
+	pixman_f_transform_scale(&buf2img, NULL, get_output_flipped(transform), 1);
+	pixman_f_transform_translate(&buf2img, NULL,
+		(double)width / 2, (double)height / 2);
+
+	struct pixman_f_transform img2buf;
+	pixman_f_transform_invert(&img2buf, &buf2img);
+	struct pixman_transform i2b_fixedpt;
+	pixman_transform_from_pixman_f_transform(&i2b_fixedpt, &img2buf);
+	pixman_image_set_transform(buffer_image, &i2b_fixedpt);
+
+	struct grim_box dest = { 0, 0, width, height };
+	if (!blit_rotated(buffer_image, image, &i2b_fixedpt, &dest)) {
+		pixman_image_composite32(PIXMAN_OP_SRC, buffer_image, NULL, image,
+			0, 0, 0, 0, 0, 0, width, height);
+	}
+	pixman_image_unref(buffer_image);
+	return image;
+}
+
+pixman_image_t *grim_render(struct grim_state *state,
+		const struct grim_box *geometry, double scale) {
+	int32_t width, height;
+	if (!get_render_size(geometry, scale, &width, &height)) {
+		return NULL;
+	}
+	if (grim_render_needs_bands(geometry, scale, 0)) {
+		fprintf(stderr, "image is too large to be rendered at once\n");
+		return NULL;
+	}
+
+	pixman_image_t *common_image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+		width, height, NULL, 0);
+	if (!common_image) {
+		fprintf(stderr, "Failed to create image\n");
+		return NULL;
+	}
+
+	if (!grim_render_to_image(state, geometry, scale, common_image)) {
+		pixman_image_unref(common_image);
+		return NULL;
+	}
 	return common_image;
 }
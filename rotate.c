@@ -0,0 +1,115 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rotate.h"
+
+// Small enough for a tile of the source and one of the destination to stay
+// in L1, whichever direction the source is walked in
+#define TILE_SIZE 32
+
+// Returns -1, 0 or 1 for a matrix coefficient, or 2 for anything else
+static int unit_coefficient(pixman_fixed_t value) {
+	switch (value) {
+	case -pixman_fixed_1:
+		return -1;
+	case 0:
+		return 0;
+	case pixman_fixed_1:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+static bool is_supported_format(pixman_format_code_t format) {
+	return format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8;
+}
+
+bool blit_rotated(pixman_image_t *src, pixman_image_t *dest,
+		const struct pixman_transform *dest2src, const struct grim_box *dest_box) {
+	pixman_format_code_t src_format = pixman_image_get_format(src);
+	if (!is_supported_format(src_format) ||
+			pixman_image_get_format(dest) != PIXMAN_a8r8g8b8) {
+		return false;
+	}
+
+	const pixman_fixed_t (*m)[3] = dest2src->matrix;
+	int a = unit_coefficient(m[0][0]), b = unit_coefficient(m[0][1]);
+	int c = unit_coefficient(m[1][0]), d = unit_coefficient(m[1][1]);
+	if (a == 2 || b == 2 || c == 2 || d == 2 ||
+			m[2][0] != 0 || m[2][1] != 0 || m[2][2] != pixman_fixed_1 ||
+			pixman_fixed_frac(m[0][2]) != 0 ||
+			pixman_fixed_frac(m[1][2]) != 0) {
+		return false;
+	}
+	// Only permutations of the axes, and a plain copy is best left to
+	// pixman's own blitter
+	if (a * d - b * c == 0 || a * b != 0 || c * d != 0 || (a == 1 && d == 1)) {
+		return false;
+	}
+
+	// Pixel centers map to pixel centers: the source pixel of the first
+	// destination pixel is found by mapping its center
+	int sx0 = pixman_fixed_to_int(m[0][2]) + (a + b < 0 ? -1 : 0);
+	int sy0 = pixman_fixed_to_int(m[1][2]) + (c + d < 0 ? -1 : 0);
+
+	// Only draw the part of the box inside dest
+	int dest_width = pixman_image_get_width(dest);
+	int dest_height = pixman_image_get_height(dest);
+	int x1 = dest_box->x > 0 ? dest_box->x : 0;
+	int y1 = dest_box->y > 0 ? dest_box->y : 0;
+	int x2 = dest_box->x + dest_box->width;
+	int y2 = dest_box->y + dest_box->height;
+	x2 = x2 < dest_width ? x2 : dest_width;
+	y2 = y2 < dest_height ? y2 : dest_height;
+	if (x1 >= x2 || y1 >= y2) {
+		return true;
+	}
+
+	// The mapping is affine, so checking the corners is enough to never
+	// read outside src
+	int src_width = pixman_image_get_width(src);
+	int src_height = pixman_image_get_height(src);
+	int corners[][2] = {
+		{ x1, y1 }, { x2 - 1, y1 }, { x1, y2 - 1 }, { x2 - 1, y2 - 1 },
+	};
+	for (size_t i = 0; i < sizeof(corners) / sizeof(corners[0]); i++) {
+		int u = corners[i][0] - dest_box->x, v = corners[i][1] - dest_box->y;
+		int sx = sx0 + a * u + b * v, sy = sy0 + c * u + d * v;
+		if (sx < 0 || sx >= src_width || sy < 0 || sy >= src_height) {
+			return false;
+		}
+	}
+
+	const unsigned char *src_data = (unsigned char *)pixman_image_get_data(src);
+	unsigned char *dest_data = (unsigned char *)pixman_image_get_data(dest);
+	ptrdiff_t src_stride = pixman_image_get_stride(src) / 4;
+	int dest_stride = pixman_image_get_stride(dest);
+	// The padding byte of x8r8g8b8 becomes an opaque alpha
+	uint32_t alpha = src_format == PIXMAN_x8r8g8b8 ? 0xff000000 : 0;
+
+	// Step in the source, in pixels, when going right or down in dest
+	ptrdiff_t step_x = a + c * src_stride;
+	ptrdiff_t step_y = b + d * src_stride;
+	const uint32_t *origin = (const uint32_t *)src_data +
+		(sy0 + c * (x1 - dest_box->x) + d * (y1 - dest_box->y)) * src_stride +
+		sx0 + a * (x1 - dest_box->x) + b * (y1 - dest_box->y);
+
+	for (int ty = y1; ty < y2; ty += TILE_SIZE) {
+		int th = y2 - ty < TILE_SIZE ? y2 - ty : TILE_SIZE;
+		for (int tx = x1; tx < x2; tx += TILE_SIZE) {
+			int tw = x2 - tx < TILE_SIZE ? x2 - tx : TILE_SIZE;
+			for (int y = ty; y < ty + th; y++) {
+				uint32_t *restrict out =
+					(uint32_t *)(dest_data + (size_t)y * dest_stride) + tx;
+				const uint32_t *restrict in = origin +
+					(tx - x1) * step_x + (y - y1) * step_y;
+				for (int x = 0; x < tw; x++) {
+					out[x] = in[x * step_x] | alpha;
+				}
+			}
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,329 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "downscale.h"
+#include "hash.h"
+#include "pool.h"
+#include "tiles.h"
+
+// Tiles are small enough for viewers to fetch few more pixels than shown,
+// and large enough to keep the number of files reasonable
+#define DZI_TILE_SIZE 256
+
+// Hashes of the last tiles written, to skip the unchanged ones next time.
+// The first line holds the image size, tile size and extension they are
+// valid for, then there is one hash per tile, level by level, row by row.
+#define HASHES_NAME "grim.hashes"
+
+struct tile_job {
+	const struct grim_encode_options *options;
+	pixman_image_t *level_image;
+	int32_t x, y, width, height;
+	char path[PATH_MAX];
+	bool has_prev_hash;
+	uint64_t prev_hash, hash;
+	bool ok;
+};
+
+static int write_stream(void *data, const void *buf, size_t len) {
+	FILE *file = data;
+	if (fwrite(buf, 1, len, file) < len) {
+		fprintf(stderr, "failed to write: %s\n", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static const char *get_tile_extension(enum grim_filetype filetype) {
+	switch (filetype) {
+	case GRIM_FILETYPE_PNG:
+		return "png";
+	case GRIM_FILETYPE_JPEG:
+		return "jpeg";
+	case GRIM_FILETYPE_WEBP:
+		return "webp";
+	case GRIM_FILETYPE_PPM:
+		break;
+	}
+	return NULL;
+}
+
+static bool make_dir(const char *path) {
+	if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "failed to create '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Written next to the final path, then renamed over it, so that viewers
+// never load half a file
+static FILE *open_tmp(const char *path, char tmp_path[static PATH_MAX]) {
+	if (snprintf(tmp_path, PATH_MAX, "%s.tmp", path) >= PATH_MAX) {
+		fprintf(stderr, "path '%s' is too long\n", path);
+		return NULL;
+	}
+	FILE *f = fopen(tmp_path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "failed to open '%s': %s\n", tmp_path,
+			strerror(errno));
+	}
+	return f;
+}
+
+static bool close_tmp(FILE *f, const char *tmp_path, const char *path,
+		bool ok) {
+	if (fclose(f) != 0) {
+		ok = false;
+	}
+	if (ok && rename(tmp_path, path) != 0) {
+		ok = false;
+	}
+	if (!ok) {
+		fprintf(stderr, "failed to write '%s': %s\n", path, strerror(errno));
+		unlink(tmp_path);
+	}
+	return ok;
+}
+
+static void process_tile(void *data) {
+	struct tile_job *job = data;
+	job->ok = false;
+
+	// The tile is a view into the level, nothing is copied
+	pixman_image_t *level = job->level_image;
+	int stride = pixman_image_get_stride(level);
+	uint32_t *level_data = pixman_image_get_data(level);
+	pixman_image_t *tile = pixman_image_create_bits(
+		pixman_image_get_format(level), job->width, job->height,
+		(uint32_t *)((char *)level_data + (size_t)job->y * stride) + job->x,
+		stride);
+	if (tile == NULL) {
+		fprintf(stderr, "failed to create tile image\n");
+		return;
+	}
+
+	job->hash = hash_image(tile);
+	if (job->has_prev_hash && job->prev_hash == job->hash &&
+			access(job->path, F_OK) == 0) {
+		pixman_image_unref(tile);
+		job->ok = true;
+		return;
+	}
+
+	char tmp_path[PATH_MAX];
+	FILE *f = open_tmp(job->path, tmp_path);
+	if (f != NULL) {
+		bool ok = grim_encode(tile, job->options, write_stream, f) == 0;
+		job->ok = close_tmp(f, tmp_path, job->path, ok);
+	}
+	pixman_image_unref(tile);
+}
+
+static size_t count_tiles(int32_t width, int32_t height) {
+	size_t cols = (width + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+	size_t rows = (height + DZI_TILE_SIZE - 1) / DZI_TILE_SIZE;
+	return cols * rows;
+}
+
+// Returns the number of hashes read, 0 if they are for another pyramid
+static size_t read_hashes(const char *dir, int32_t width, int32_t height,
+		const char *ext, uint64_t *hashes, size_t n_tiles) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, HASHES_NAME);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		return 0;
+	}
+
+	int32_t prev_width, prev_height;
+	int tile_size;
+	char prev_ext[8];
+	size_t n = 0;
+	if (fscanf(f, "%" SCNd32 " %" SCNd32 " %d %7s", &prev_width,
+			&prev_height, &tile_size, prev_ext) == 4 &&
+			prev_width == width && prev_height == height &&
+			tile_size == DZI_TILE_SIZE && strcmp(prev_ext, ext) == 0) {
+		while (n < n_tiles && fscanf(f, "%" SCNx64, &hashes[n]) == 1) {
+			n++;
+		}
+	}
+	fclose(f);
+	return n;
+}
+
+static bool write_hashes(const char *dir, int32_t width, int32_t height,
+		const char *ext, const struct tile_job *jobs, size_t n_tiles) {
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, HASHES_NAME);
+	FILE *f = open_tmp(path, tmp_path);
+	if (f == NULL) {
+		return false;
+	}
+	bool ok = fprintf(f, "%d %d %d %s\n", width, height, DZI_TILE_SIZE,
+		ext) > 0;
+	for (size_t i = 0; i < n_tiles && ok; i++) {
+		ok = fprintf(f, "%016" PRIx64 "\n", jobs[i].hash) > 0;
+	}
+	return close_tmp(f, tmp_path, path, ok);
+}
+
+static bool write_manifest(const char *dir, int32_t width, int32_t height,
+		const char *ext) {
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/grim.dzi", dir);
+	FILE *f = open_tmp(path, tmp_path);
+	if (f == NULL) {
+		return false;
+	}
+	bool ok = fprintf(f,
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+		"Format=\"%s\" Overlap=\"0\" TileSize=\"%d\">\n"
+		"  <Size Width=\"%d\" Height=\"%d\"/>\n"
+		"</Image>\n", ext, DZI_TILE_SIZE, width, height) > 0;
+	return close_tmp(f, tmp_path, path, ok);
+}
+
+bool write_tiles(pixman_image_t *image, const char *dir,
+		const struct grim_encode_options *options) {
+	const char *ext = get_tile_extension(options->filetype);
+	if (ext == NULL) {
+		fprintf(stderr, "tiles can't be written as ppm\n");
+		return false;
+	}
+
+	int32_t width = pixman_image_get_width(image);
+	int32_t height = pixman_image_get_height(image);
+	// Each level halves the previous one, rounding up, down to a single
+	// pixel at level 0
+	int max_level = 0;
+	while ((width - 1) >> max_level > 0 || (height - 1) >> max_level > 0) {
+		max_level++;
+	}
+
+	size_t n_tiles = 0;
+	for (int level = 0; level <= max_level; level++) {
+		int shift = max_level - level;
+		n_tiles += count_tiles(((width - 1) >> shift) + 1,
+			((height - 1) >> shift) + 1);
+	}
+
+	// Leaves room for the names of the files in dir
+	if (strlen(dir) > PATH_MAX - 32) {
+		fprintf(stderr, "path '%s' is too long\n", dir);
+		return false;
+	}
+	char files_dir[PATH_MAX];
+	snprintf(files_dir, sizeof(files_dir), "%s/grim_files", dir);
+	if (!make_dir(dir) || !make_dir(files_dir)) {
+		return false;
+	}
+
+	struct tile_job *jobs = calloc(n_tiles, sizeof(struct tile_job));
+	uint64_t *prev_hashes = calloc(n_tiles, sizeof(uint64_t));
+	pixman_image_t **levels = calloc(max_level + 1, sizeof(pixman_image_t *));
+	if (jobs == NULL || prev_hashes == NULL || levels == NULL) {
+		fprintf(stderr, "failed to allocate tiles\n");
+		free(jobs);
+		free(prev_hashes);
+		free(levels);
+		return false;
+	}
+	size_t n_prev_hashes = read_hashes(dir, width, height, ext, prev_hashes,
+		n_tiles);
+
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	struct pool *pool = pool_create(n_cpus > 0 ? (size_t)n_cpus : 1);
+	if (pool == NULL) {
+		fprintf(stderr, "failed to create worker pool\n");
+		free(jobs);
+		free(prev_hashes);
+		free(levels);
+		return false;
+	}
+
+	// From the largest level down, each one reduced from the previous one
+	// while its tiles are being encoded. Jobs are indexed from level 0.
+	bool ok = true;
+	size_t level_end = n_tiles;
+	levels[max_level] = pixman_image_ref(image);
+	for (int level = max_level; level >= 0 && ok; level--) {
+		pixman_image_t *level_image = levels[level];
+		int32_t level_width = pixman_image_get_width(level_image);
+		int32_t level_height = pixman_image_get_height(level_image);
+		size_t level_start = level_end - count_tiles(level_width, level_height);
+
+		char level_dir[PATH_MAX];
+		if (snprintf(level_dir, sizeof(level_dir), "%s/%d", files_dir,
+				level) >= (int)sizeof(level_dir) || !make_dir(level_dir)) {
+			ok = false;
+			break;
+		}
+
+		size_t i = level_start;
+		for (int32_t y = 0; y < level_height; y += DZI_TILE_SIZE) {
+			for (int32_t x = 0; x < level_width; x += DZI_TILE_SIZE) {
+				struct tile_job *job = &jobs[i];
+				job->options = options;
+				job->level_image = level_image;
+				job->x = x;
+				job->y = y;
+				job->width = level_width - x < DZI_TILE_SIZE ?
+					level_width - x : DZI_TILE_SIZE;
+				job->height = level_height - y < DZI_TILE_SIZE ?
+					level_height - y : DZI_TILE_SIZE;
+				if (snprintf(job->path, sizeof(job->path), "%s/%d_%d.%s",
+						level_dir, x / DZI_TILE_SIZE, y / DZI_TILE_SIZE,
+						ext) >= (int)sizeof(job->path)) {
+					fprintf(stderr, "path '%s' is too long\n", level_dir);
+					ok = false;
+				}
+				job->has_prev_hash = i < n_prev_hashes;
+				job->prev_hash = prev_hashes[i];
+				if (ok && !pool_submit(pool, process_tile, job)) {
+					fprintf(stderr, "failed to queue tile\n");
+					ok = false;
+				}
+				i++;
+			}
+		}
+		level_end = level_start;
+
+		if (level > 0 && ok) {
+			levels[level - 1] = box_downscale(level_image, 1);
+			if (levels[level - 1] == NULL) {
+				fprintf(stderr, "failed to reduce level %d\n", level);
+				ok = false;
+			}
+		}
+	}
+	pool_finish(pool);
+
+	for (size_t i = 0; i < n_tiles && ok; i++) {
+		ok = jobs[i].ok;
+	}
+	if (ok) {
+		// Once all tiles are in place, so that viewers don't request
+		// missing ones
+		ok = write_manifest(dir, width, height, ext) &&
+			write_hashes(dir, width, height, ext, jobs, n_tiles);
+	}
+
+	for (int level = 0; level <= max_level; level++) {
+		if (levels[level] != NULL) {
+			pixman_image_unref(levels[level]);
+		}
+	}
+	free(levels);
+	free(prev_hashes);
+	free(jobs);
+	return ok;
+}
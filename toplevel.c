@@ -0,0 +1,189 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "copy-capture.h"
+#include "grim.h"
+#include "render.h"
+
+struct grim_toplevel {
+	struct ext_foreign_toplevel_handle_v1 *handle;
+	struct wl_list link;
+	char *identifier, *app_id, *title;
+	bool done;
+};
+
+static void replace_string(char **dst, const char *src) {
+	free(*dst);
+	*dst = strdup(src);
+}
+
+static void toplevel_handle_closed(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct grim_toplevel *toplevel = data;
+	// Can't be captured anymore
+	toplevel->done = false;
+}
+
+static void toplevel_handle_done(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct grim_toplevel *toplevel = data;
+	toplevel->done = true;
+}
+
+static void toplevel_handle_title(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *title) {
+	struct grim_toplevel *toplevel = data;
+	replace_string(&toplevel->title, title);
+}
+
+static void toplevel_handle_app_id(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *app_id) {
+	struct grim_toplevel *toplevel = data;
+	replace_string(&toplevel->app_id, app_id);
+}
+
+static void toplevel_handle_identifier(void *data,
+		struct ext_foreign_toplevel_handle_v1 *handle, const char *identifier) {
+	struct grim_toplevel *toplevel = data;
+	replace_string(&toplevel->identifier, identifier);
+}
+
+static const struct ext_foreign_toplevel_handle_v1_listener toplevel_listener = {
+	.closed = toplevel_handle_closed,
+	.done = toplevel_handle_done,
+	.title = toplevel_handle_title,
+	.app_id = toplevel_handle_app_id,
+	.identifier = toplevel_handle_identifier,
+};
+
+static void toplevel_list_handle_toplevel(void *data,
+		struct ext_foreign_toplevel_list_v1 *list,
+		struct ext_foreign_toplevel_handle_v1 *handle) {
+	struct wl_list *toplevels = data;
+	struct grim_toplevel *toplevel = calloc(1, sizeof(*toplevel));
+	if (toplevel == NULL) {
+		fprintf(stderr, "failed to allocate toplevel\n");
+		ext_foreign_toplevel_handle_v1_destroy(handle);
+		return;
+	}
+	toplevel->handle = handle;
+	ext_foreign_toplevel_handle_v1_add_listener(handle, &toplevel_listener,
+		toplevel);
+	wl_list_insert(toplevels->prev, &toplevel->link);
+}
+
+static void toplevel_list_handle_finished(void *data,
+		struct ext_foreign_toplevel_list_v1 *list) {
+	// No-op
+}
+
+static const struct ext_foreign_toplevel_list_v1_listener toplevel_list_listener = {
+	.toplevel = toplevel_list_handle_toplevel,
+	.finished = toplevel_list_handle_finished,
+};
+
+static struct grim_toplevel *find_toplevel(struct wl_list *toplevels,
+		const char *identifier) {
+	struct grim_toplevel *toplevel;
+	wl_list_for_each(toplevel, toplevels, link) {
+		if (toplevel->done && toplevel->identifier != NULL &&
+				strcmp(toplevel->identifier, identifier) == 0) {
+			return toplevel;
+		}
+	}
+
+	fprintf(stderr, "unknown toplevel '%s', available ones are:\n",
+		identifier);
+	wl_list_for_each(toplevel, toplevels, link) {
+		if (toplevel->done && toplevel->identifier != NULL) {
+			fprintf(stderr, "  %s\t%s\t%s\n", toplevel->identifier,
+				toplevel->app_id ? toplevel->app_id : "",
+				toplevel->title ? toplevel->title : "");
+		}
+	}
+	return NULL;
+}
+
+static pixman_image_t *capture_toplevel(struct grim_state *state,
+		struct grim_toplevel *toplevel, bool with_cursor) {
+	struct ext_image_capture_source_v1 *source =
+		ext_foreign_toplevel_image_capture_source_manager_v1_create_source(
+			state->toplevel_source_manager, toplevel->handle);
+	struct grim_buffer *buffer = NULL, *spare_buffer = NULL;
+	struct grim_copy_capture *capture = create_copy_capture(state, NULL,
+		toplevel->identifier, source, &buffer, &spare_buffer);
+	if (capture == NULL) {
+		return NULL;
+	}
+
+	state->n_pending = 1;
+	state->n_done = 0;
+	state->capture_failed = false;
+	copy_capture_start(capture, with_cursor);
+	while (state->n_done < state->n_pending && !state->capture_failed) {
+		if (wl_display_dispatch(state->display) == -1) {
+			state->capture_failed = true;
+		}
+	}
+
+	pixman_image_t *image = NULL;
+	if (!state->capture_failed) {
+		image = render_buffer(buffer, capture->transform);
+	} else {
+		fprintf(stderr, "failed to capture toplevel %s\n",
+			toplevel->identifier);
+	}
+	destroy_copy_capture(capture);
+	destroy_buffer(buffer);
+	destroy_buffer(spare_buffer);
+	return image;
+}
+
+pixman_image_t *grim_capture_toplevel(struct grim_state *state,
+		const char *identifier, bool with_cursor) {
+	if (state->display == NULL) {
+		fprintf(stderr, "can't capture without a compositor\n");
+		return NULL;
+	}
+	if (state->copy_capture_manager == NULL ||
+			state->toplevel_source_manager == NULL ||
+			state->toplevel_list_name == 0) {
+		fprintf(stderr, "compositor doesn't support capturing toplevels "
+			"with ext-image-copy-capture-v1\n");
+		return NULL;
+	}
+
+	struct wl_list toplevels;
+	wl_list_init(&toplevels);
+	struct ext_foreign_toplevel_list_v1 *list = wl_registry_bind(
+		state->registry, state->toplevel_list_name,
+		&ext_foreign_toplevel_list_v1_interface, 1);
+	ext_foreign_toplevel_list_v1_add_listener(list, &toplevel_list_listener,
+		&toplevels);
+	// Toplevels are sent right away, each along with its properties. Later
+	// ones are ignored.
+	pixman_image_t *image = NULL;
+	if (wl_display_roundtrip(state->display) != -1) {
+		struct grim_toplevel *toplevel = find_toplevel(&toplevels, identifier);
+		if (toplevel != NULL) {
+			image = capture_toplevel(state, toplevel, with_cursor);
+		}
+	} else {
+		fprintf(stderr, "failed to list toplevels\n");
+	}
+
+	struct grim_toplevel *toplevel, *tmp;
+	wl_list_for_each_safe(toplevel, tmp, &toplevels, link) {
+		wl_list_remove(&toplevel->link);
+		ext_foreign_toplevel_handle_v1_destroy(toplevel->handle);
+		free(toplevel->identifier);
+		free(toplevel->app_id);
+		free(toplevel->title);
+		free(toplevel);
+	}
+	ext_foreign_toplevel_list_v1_destroy(list);
+	return image;
+}
@@ -0,0 +1,304 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "probes.h"
+#include "write_apng.h"
+
+// libpng doesn't write APNG. Each frame is written as a standalone PNG of
+// the rectangle which changed, whose IDAT chunks are then moved into the
+// animation, renamed fdAT after the first frame.
+
+#define APNG_DISPOSE_OP_NONE 0
+#define APNG_BLEND_OP_SOURCE 0
+
+static const uint8_t png_signature[] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+};
+
+struct png_buffer {
+	uint8_t *data;
+	size_t len, cap;
+};
+
+struct grim_apng {
+	struct grim_sink *sink;
+	struct grim_png_params params;
+	uint32_t n_frames, n_written;
+	uint32_t sequence; // of fcTL and fdAT chunks
+	int32_t width, height;
+	bool fully_opaque;
+	pixman_image_t *prev;
+	struct png_buffer frame;
+};
+
+static int png_buffer_write(void *data, const void *buf, size_t len) {
+	struct png_buffer *buffer = data;
+	if (buffer->len + len > buffer->cap) {
+		size_t cap = buffer->cap > 0 ? buffer->cap : 64 * 1024;
+		while (buffer->len + len > cap) {
+			cap *= 2;
+		}
+		uint8_t *new_data = realloc(buffer->data, cap);
+		if (new_data == NULL) {
+			fprintf(stderr, "failed to allocate png frame\n");
+			return -1;
+		}
+		buffer->data = new_data;
+		buffer->cap = cap;
+	}
+	memcpy(buffer->data + buffer->len, buf, len);
+	buffer->len += len;
+	return 0;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+		(uint32_t)p[2] << 8 | p[3];
+}
+
+// The data is written in two parts, so that fdAT chunks can get their
+// sequence number in front of the IDAT data without copying it
+static int write_chunk(struct grim_sink *sink, const char type[static 4],
+		const uint8_t *prefix, size_t prefix_len, const uint8_t *data,
+		size_t len) {
+	uint8_t header[8];
+	put_u32(header, prefix_len + len);
+	memcpy(header + 4, type, 4);
+
+	// crc32() resets the checksum when given a NULL buffer
+	uLong crc = crc32(0, header + 4, 4);
+	if (prefix_len > 0) {
+		crc = crc32(crc, prefix, prefix_len);
+	}
+	if (len > 0) {
+		crc = crc32(crc, data, len);
+	}
+	uint8_t footer[4];
+	put_u32(footer, crc);
+
+	if (sink_write(sink, header, sizeof(header)) != 0 ||
+			sink_write(sink, prefix, prefix_len) != 0 ||
+			sink_write(sink, data, len) != 0 ||
+			sink_write(sink, footer, sizeof(footer)) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+static int write_fctl(struct grim_apng *apng, const struct grim_box *rect,
+		uint32_t delay_ms) {
+	if (delay_ms > UINT16_MAX) {
+		delay_ms = UINT16_MAX;
+	}
+	uint8_t fctl[26];
+	put_u32(fctl, apng->sequence++);
+	put_u32(fctl + 4, rect->width);
+	put_u32(fctl + 8, rect->height);
+	put_u32(fctl + 12, rect->x);
+	put_u32(fctl + 16, rect->y);
+	fctl[20] = delay_ms >> 8;
+	fctl[21] = delay_ms;
+	fctl[22] = 1000 >> 8; // delay denominator, in ms
+	fctl[23] = 1000 & 0xff;
+	fctl[24] = APNG_DISPOSE_OP_NONE;
+	fctl[25] = APNG_BLEND_OP_SOURCE;
+	return write_chunk(apng->sink, "fcTL", NULL, 0, fctl, sizeof(fctl));
+}
+
+// Moves the chunks of the standalone PNG of a frame into the animation
+static int write_frame_chunks(struct grim_apng *apng, bool first) {
+	const uint8_t *p = apng->frame.data;
+	const uint8_t *end = p + apng->frame.len;
+	if (apng->frame.len < sizeof(png_signature) ||
+			memcmp(p, png_signature, sizeof(png_signature)) != 0) {
+		return -1;
+	}
+	p += sizeof(png_signature);
+
+	while (end - p >= 12) {
+		uint32_t len = get_u32(p);
+		const uint8_t *type = p + 4;
+		const uint8_t *data = p + 8;
+		if ((size_t)(end - data) < (size_t)len + 4) {
+			return -1;
+		}
+		p = data + len + 4;
+
+		if (memcmp(type, "IDAT", 4) != 0) {
+			// IHDR was written along with the first frame, and IEND is
+			// written last
+			continue;
+		}
+		int ret;
+		if (first) {
+			ret = write_chunk(apng->sink, "IDAT", NULL, 0, data, len);
+		} else {
+			uint8_t sequence[4];
+			put_u32(sequence, apng->sequence++);
+			ret = write_chunk(apng->sink, "fdAT", sequence,
+				sizeof(sequence), data, len);
+		}
+		if (ret != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_header(struct grim_apng *apng) {
+	if (sink_write(apng->sink, png_signature, sizeof(png_signature)) != 0) {
+		return -1;
+	}
+
+	// IHDR of the first frame, which is the whole image
+	const uint8_t *ihdr = apng->frame.data + sizeof(png_signature);
+	if (apng->frame.len < sizeof(png_signature) + 8 + 13 + 4 ||
+			memcmp(ihdr + 4, "IHDR", 4) != 0) {
+		return -1;
+	}
+	if (write_chunk(apng->sink, "IHDR", NULL, 0, ihdr + 8, 13) != 0) {
+		return -1;
+	}
+
+	uint8_t actl[8];
+	put_u32(actl, apng->n_frames);
+	put_u32(actl + 4, 0); // loop forever
+	return write_chunk(apng->sink, "acTL", NULL, 0, actl, sizeof(actl));
+}
+
+// Bounding box of the pixels which differ between two images of the same
+// size. Returns false if there are none.
+static bool get_changed_rect(pixman_image_t *a, pixman_image_t *b,
+		struct grim_box *rect) {
+	int width = pixman_image_get_width(a);
+	int height = pixman_image_get_height(a);
+	int stride_a = pixman_image_get_stride(a);
+	int stride_b = pixman_image_get_stride(b);
+	const uint8_t *data_a = (const uint8_t *)pixman_image_get_data(a);
+	const uint8_t *data_b = (const uint8_t *)pixman_image_get_data(b);
+
+	int32_t x1 = width, y1 = height, x2 = 0, y2 = 0;
+	for (int y = 0; y < height; y++) {
+		const uint32_t *row_a =
+			(const uint32_t *)(data_a + (size_t)y * stride_a);
+		const uint32_t *row_b =
+			(const uint32_t *)(data_b + (size_t)y * stride_b);
+		if (memcmp(row_a, row_b, (size_t)width * 4) == 0) {
+			continue;
+		}
+		y1 = y < y1 ? y : y1;
+		y2 = y + 1;
+
+		// Only the columns outside of the current box are left to check
+		int x = 0;
+		while (x < x1 && row_a[x] == row_b[x]) {
+			x++;
+		}
+		x1 = x < x1 ? x : x1;
+		x = width;
+		while (x > x2 && row_a[x - 1] == row_b[x - 1]) {
+			x--;
+		}
+		x2 = x > x2 ? x : x2;
+	}
+
+	if (y2 == 0) {
+		return false;
+	}
+	*rect = (struct grim_box){ x1, y1, x2 - x1, y2 - y1 };
+	return true;
+}
+
+struct grim_apng *apng_begin(struct grim_sink *sink,
+		const struct grim_png_params *params, uint32_t n_frames) {
+	struct grim_apng *apng = calloc(1, sizeof(*apng));
+	if (apng == NULL) {
+		fprintf(stderr, "failed to allocate apng\n");
+		return NULL;
+	}
+	apng->sink = sink;
+	apng->params = *params;
+	apng->n_frames = n_frames;
+	return apng;
+}
+
+int apng_add_frame(struct grim_apng *apng, pixman_image_t *image,
+		uint32_t delay_ms) {
+	int32_t width = pixman_image_get_width(image);
+	int32_t height = pixman_image_get_height(image);
+	bool first = apng->prev == NULL;
+	if (apng->n_written == apng->n_frames) {
+		fprintf(stderr, "too many animation frames\n");
+		return -1;
+	}
+	if (!first && (width != apng->width || height != apng->height)) {
+		fprintf(stderr, "animation frames must all have the same size\n");
+		return -1;
+	}
+
+	struct grim_box rect = { 0, 0, width, height };
+	if (first) {
+		// The color type can't change between frames
+		apng->width = width;
+		apng->height = height;
+		apng->fully_opaque = is_image_opaque(image);
+	} else if (!get_changed_rect(apng->prev, image, &rect)) {
+		// Every frame must be written, a single unchanged pixel will do
+		rect = (struct grim_box){ 0, 0, 1, 1 };
+	}
+	GRIM_PROBE(apng_frame, apng->n_written, rect.x, rect.y, rect.width,
+		rect.height);
+
+	apng->frame.len = 0;
+	struct grim_sink frame_sink = {
+		.write = png_buffer_write,
+		.data = &apng->frame,
+	};
+	if (write_png_rect_to_sink(image, &rect, apng->fully_opaque, &frame_sink,
+			&apng->params) != 0) {
+		return -1;
+	}
+
+	if ((first && write_header(apng) != 0) ||
+			write_fctl(apng, &rect, delay_ms) != 0 ||
+			write_frame_chunks(apng, first) != 0) {
+		fprintf(stderr, "failed to write apng frame\n");
+		return -1;
+	}
+
+	if (apng->prev != NULL) {
+		pixman_image_unref(apng->prev);
+	}
+	apng->prev = pixman_image_ref(image);
+	apng->n_written++;
+	return 0;
+}
+
+int apng_end(struct grim_apng *apng) {
+	int ret = 0;
+	if (apng->n_written != apng->n_frames) {
+		fprintf(stderr, "apng has %u frames, expected %u\n",
+			apng->n_written, apng->n_frames);
+		ret = -1;
+	} else if (write_chunk(apng->sink, "IEND", NULL, 0, NULL, 0) != 0) {
+		fprintf(stderr, "failed to write apng\n");
+		ret = -1;
+	}
+
+	if (apng->prev != NULL) {
+		pixman_image_unref(apng->prev);
+	}
+	free(apng->frame.data);
+	free(apng);
+	return ret;
+}
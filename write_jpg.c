@@ -3,6 +3,7 @@
  * @license This code is free software. Do whatever you like to do with it.
  */
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -13,51 +14,215 @@
 #include <unistd.h>
 #include <jpeglib.h>
 
+#include "deadline.h"
+#include "probes.h"
 #include "write_jpg.h"
+#include "writer.h"
 
-int write_to_jpeg_stream(pixman_image_t *image, FILE *stream, int quality) {
+void init_jpeg_params(struct grim_jpeg_params *params, int quality) {
+	*params = (struct grim_jpeg_params){
+		.quality = quality,
+	};
+}
+
+// Hands the compressed data over to the sink as it comes, rather than
+// keeping it all in memory
+struct jpeg_sink_dest {
+	struct jpeg_destination_mgr pub;
+	struct grim_sink *sink;
+	JOCTET buffer[64 * 1024];
+	bool failed;
+};
+
+static void sink_init_destination(j_compress_ptr cinfo) {
+	struct jpeg_sink_dest *dest = (struct jpeg_sink_dest *)cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = sizeof(dest->buffer);
+}
+
+static boolean sink_empty_output_buffer(j_compress_ptr cinfo) {
+	struct jpeg_sink_dest *dest = (struct jpeg_sink_dest *)cinfo->dest;
+	// On error, the rest is dropped and the failure reported at the end
+	if (!dest->failed &&
+			sink_write(dest->sink, dest->buffer, sizeof(dest->buffer)) != 0) {
+		dest->failed = true;
+	}
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = sizeof(dest->buffer);
+	return TRUE;
+}
+
+static void sink_term_destination(j_compress_ptr cinfo) {
+	struct jpeg_sink_dest *dest = (struct jpeg_sink_dest *)cinfo->dest;
+	size_t len = sizeof(dest->buffer) - dest->pub.free_in_buffer;
+	if (!dest->failed && sink_write(dest->sink, dest->buffer, len) != 0) {
+		dest->failed = true;
+	}
+}
+
+static int begin_jpeg(struct jpeg_compress_struct *cinfo,
+		struct jpeg_error_mgr *jerr, struct jpeg_sink_dest *dest,
+		struct grim_sink *sink, const struct grim_jpeg_params *params,
+		int width, int height, bool has_alpha) {
+	if (width > JPEG_MAX_DIMENSION || height > JPEG_MAX_DIMENSION) {
+		fprintf(stderr, "image is too large for jpeg, at most %ld pixels "
+			"a side\n", (long)JPEG_MAX_DIMENSION);
+		return -1;
+	}
+
+	cinfo->err = jpeg_std_error(jerr);
+	jpeg_create_compress(cinfo);
+
+	*dest = (struct jpeg_sink_dest){
+		.pub = {
+			.init_destination = sink_init_destination,
+			.empty_output_buffer = sink_empty_output_buffer,
+			.term_destination = sink_term_destination,
+		},
+		.sink = sink,
+	};
+	cinfo->dest = &dest->pub;
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	if (has_alpha) {
+		cinfo->in_color_space = JCS_EXT_BGRA;
+	} else {
+		cinfo->in_color_space = JCS_EXT_BGRX;
+	}
+	cinfo->input_components = 4;
+
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, params->quality, TRUE);
+	if (params->fast_dct) {
+		cinfo->dct_method = JDCT_IFAST;
+	}
+	if (params->optimize) {
+		cinfo->optimize_coding = TRUE;
+	}
+	if (params->progressive) {
+		jpeg_simple_progression(cinfo);
+	}
+
+	jpeg_start_compress(cinfo, TRUE);
+	return 0;
+}
+
+static int end_jpeg(struct jpeg_compress_struct *cinfo,
+		struct jpeg_sink_dest *dest) {
+	jpeg_finish_compress(cinfo);
+	jpeg_destroy_compress(cinfo);
+
+	GRIM_PROBE(write_done, "jpeg", dest->sink->written);
+	if (dest->failed) {
+		fprintf(stderr, "Failed to write jpg\n");
+		return -1;
+	}
+	return 0;
+}
+
+int write_to_jpeg_sink(pixman_image_t *image, struct grim_sink *sink,
+		const struct grim_jpeg_params *params) {
 	pixman_format_code_t format = pixman_image_get_format(image);
 	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
 
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
-	JSAMPROW row_pointer[1];
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	unsigned char *data = NULL;
-	unsigned long len = 0;
-	jpeg_mem_dest(&cinfo, &data, &len);
-	cinfo.image_width = pixman_image_get_width(image);
-	cinfo.image_height = pixman_image_get_height(image);
-	if (format == PIXMAN_a8r8g8b8) {
-		cinfo.in_color_space = JCS_EXT_BGRA;
-	} else {
-		cinfo.in_color_space = JCS_EXT_BGRX;
+	struct jpeg_sink_dest dest;
+	if (begin_jpeg(&cinfo, &jerr, &dest, sink, params,
+			pixman_image_get_width(image), pixman_image_get_height(image),
+			format == PIXMAN_a8r8g8b8) != 0) {
+		return -1;
 	}
-	cinfo.input_components = 4;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-
-	jpeg_start_compress(&cinfo, TRUE);
 
+	JSAMPROW row_pointer[1];
+	size_t stride = pixman_image_get_stride(image);
 	while (cinfo.next_scanline < cinfo.image_height) {
+		if (cinfo.next_scanline % GRIM_PROBE_ROW_BATCH == 0) {
+			GRIM_PROBE(encode_rows, "jpeg", cinfo.next_scanline,
+				cinfo.image_height, cinfo.next_scanline * stride);
+		}
 		row_pointer[0] = (unsigned char *)pixman_image_get_data(image)
-			+ (cinfo.next_scanline * pixman_image_get_stride(image));
+			+ (cinfo.next_scanline * stride);
 		(void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
 	}
 
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+	return end_jpeg(&cinfo, &dest);
+}
 
-	size_t written = fwrite(data, 1, len, stream);
-	if (written < len) {
-		free(data);
-		fprintf(stderr, "Failed to write jpg; only %zu of %lu bytes written\n",
-			written, len);
+static int jpeg_band_row(void *data, const uint32_t *row, int32_t y) {
+	struct jpeg_compress_struct *cinfo = data;
+	JSAMPROW row_pointer[1] = { (JSAMPROW)row };
+	(void) jpeg_write_scanlines(cinfo, row_pointer, 1);
+	return 0;
+}
+
+int write_bands_to_jpeg_sink(const struct grim_band_source *source,
+		struct grim_sink *sink, const struct grim_jpeg_params *params) {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct jpeg_sink_dest dest;
+	// Alpha is dropped anyway
+	if (begin_jpeg(&cinfo, &jerr, &dest, sink, params, source->width,
+			source->height, false) != 0) {
 		return -1;
 	}
-	free(data);
-	return 0;
+
+	if (grim_for_each_band_row(source, jpeg_band_row, &cinfo) != 0) {
+		jpeg_destroy_compress(&cinfo);
+		return -1;
+	}
+	return end_jpeg(&cinfo, &dest);
+}
+
+static int encode_jpeg(pixman_image_t *image, struct grim_sink *sink,
+		const void *params) {
+	return write_to_jpeg_sink(image, sink, params);
+}
+
+static void choose_jpeg_params(pixman_image_t *image, long deadline_ms,
+		struct grim_jpeg_params *params) {
+	// The quality is the user's call, only trade speed for size here
+	int quality = params->quality;
+	const struct grim_jpeg_params candidates[] = {
+		{ .quality = quality, .fast_dct = true },
+		{ .quality = quality },
+		{ .quality = quality, .optimize = true },
+		{ .quality = quality, .optimize = true, .progressive = true },
+	};
+
+	struct trial_result result;
+	size_t i = choose_candidate(image, deadline_ms, encode_jpeg, candidates,
+		sizeof(candidates[0]), sizeof(candidates) / sizeof(candidates[0]),
+		&result);
+	*params = candidates[i];
+
+	fprintf(stderr, "deadline: jpeg quality %d, %s dct, %soptimized, "
+		"%sprogressive (expected %.0f ms, %.0f bytes)\n", params->quality,
+		params->fast_dct ? "fast" : "accurate",
+		params->optimize ? "" : "not ", params->progressive ? "" : "not ",
+		result.time_ms, result.size);
+}
+
+static int writer_encode(pixman_image_t *image, struct grim_sink *sink,
+		const struct grim_encode_options *options) {
+	struct grim_jpeg_params params;
+	init_jpeg_params(&params, options->quality);
+	if (options->deadline_ms > 0) {
+		choose_jpeg_params(image, options->deadline_ms, &params);
+	}
+	return write_to_jpeg_sink(image, sink, &params);
 }
+
+static int writer_encode_bands(const struct grim_band_source *source,
+		struct grim_sink *sink, const struct grim_encode_options *options) {
+	struct grim_jpeg_params params;
+	init_jpeg_params(&params, options->quality);
+	return write_bands_to_jpeg_sink(source, sink, &params);
+}
+
+const struct grim_writer grim_writer = {
+	.version = GRIM_WRITER_VERSION,
+	.name = "jpeg",
+	.encode = writer_encode,
+	.encode_bands = writer_encode_bands,
+};
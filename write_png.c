@@ -1,10 +1,17 @@
 #include <assert.h>
+#include <limits.h>
 #include <png.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <zlib.h>
 
+#include "deadline.h"
+#include "probes.h"
+#include "write_apng.h"
 #include "write_png.h"
+#include "writer.h"
 
 static void pack_row32(uint8_t *restrict row_out, const uint32_t *restrict row_in,
 		size_t width, bool fully_opaque) {
@@ -35,89 +42,325 @@ static void pack_row32(uint8_t *restrict row_out, const uint32_t *restrict row_i
 	}
 }
 
-int write_to_png_stream(pixman_image_t *image, FILE *stream,
-		int comp_level) {
-	pixman_format_code_t format = pixman_image_get_format(image);
-	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+void init_png_params(struct grim_png_params *params, int comp_level) {
+	params->comp_level = comp_level;
+	// If the level is zero (no compression), filtering will be unnecessary
+	params->filters = comp_level == 0 ? PNG_NO_FILTERS : PNG_ALL_FILTERS;
+	params->strategy = -1;
+}
 
-	int width = pixman_image_get_width(image);
-	int height = pixman_image_get_height(image);
-	int stride = pixman_image_get_stride(image);
-	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+static void png_sink_write(png_struct *png, png_byte *data, size_t len) {
+	struct grim_sink *sink = png_get_io_ptr(png);
+	if (sink_write(sink, data, len) != 0) {
+		png_error(png, "write error");
+	}
+}
 
-	bool fully_opaque = true;
-	if (format == PIXMAN_a8r8g8b8) {
-		for (int y = 0; y < height; y++) {
-			const uint32_t *row = (const uint32_t *)(data + y * stride);
-			for (int x = 0; x < width; x++) {
-				if ((row[x] >> 24) != 0xff) {
-					fully_opaque = false;
-				}
-			}
-		}
+static void png_sink_flush(png_struct *png) {
+	// Nothing is buffered on our side
+}
+
+struct png_writer {
+	png_struct *png;
+	png_info *info;
+	uint8_t *tmp_row;
+	int width;
+	bool fully_opaque;
+};
+
+static void finish_png(struct png_writer *writer) {
+	if (writer->info) {
+		png_destroy_info_struct(writer->png, &writer->info);
 	}
-	int color_type = fully_opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA;
-	int bit_depth = 8;
+	if (writer->png) {
+		png_destroy_write_struct(&writer->png, NULL);
+	}
+	free(writer->tmp_row);
+}
 
-	uint8_t *tmp_row = calloc(width, 4);
-	if (!tmp_row) {
+// libpng reports errors with longjmp, so each step below sets its own
+// landing point: the rows may be pushed from deeper down the stack
+
+static int begin_png(struct png_writer *writer, struct grim_sink *sink,
+		const struct grim_png_params *params, int width, int height,
+		bool fully_opaque) {
+	*writer = (struct png_writer){
+		.width = width,
+		.fully_opaque = fully_opaque,
+	};
+
+	writer->tmp_row = calloc(width, 4);
+	if (!writer->tmp_row) {
 		fprintf(stderr, "failed to allocate temp row\n");
 		return -1;
 	}
 
-	int ret = 0;
-	png_struct *png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+	writer->png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
 		NULL, NULL, NULL);
-	png_info *info = NULL;
-	if (!png) {
+	if (!writer->png) {
 		fprintf(stderr, "failed to allocate png struct\n");
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
-	info = png_create_info_struct(png);
-	if (!info) {
+	writer->info = png_create_info_struct(writer->png);
+	if (!writer->info) {
 		fprintf(stderr, "failed to allocate png write struct\n");
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
 
 #ifdef PNG_SETJMP_SUPPORTED
-	if (setjmp(png_jmpbuf(png))) {
+	if (setjmp(png_jmpbuf(writer->png))) {
 		fprintf(stderr, "failed to write png\n");
-		ret = -1;
-		goto cleanup;
+		return -1;
 	}
 #endif
 
-	png_init_io(png, stream);
+	png_set_write_fn(writer->png, sink, png_sink_write, png_sink_flush);
 
-	png_set_IHDR(png, info, width, height, bit_depth, color_type,
-		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-	png_write_info(png, info);
+	int color_type = fully_opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA;
+	int bit_depth = 8;
+	png_set_IHDR(writer->png, writer->info, width, height, bit_depth,
+		color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+		PNG_FILTER_TYPE_BASE);
+	png_write_info(writer->png, writer->info);
 
-	// If the level is zero (no compression), filtering will be unnecessary
-	png_set_compression_level(png, comp_level);
-	if (comp_level == 0) {
-		png_set_filter(png, 0, PNG_NO_FILTERS);
-	} else {
-		png_set_filter(png, 0, PNG_ALL_FILTERS);
+	png_set_compression_level(writer->png, params->comp_level);
+	if (params->strategy >= 0) {
+		png_set_compression_strategy(writer->png, params->strategy);
 	}
+	png_set_filter(writer->png, 0, params->filters);
+	return 0;
+}
 
+static int write_png_row(struct png_writer *writer, const uint32_t *row) {
+#ifdef PNG_SETJMP_SUPPORTED
+	if (setjmp(png_jmpbuf(writer->png))) {
+		fprintf(stderr, "failed to write png\n");
+		return -1;
+	}
+#endif
+
+	pack_row32(writer->tmp_row, row, writer->width, writer->fully_opaque);
+	png_write_row(writer->png, writer->tmp_row);
+	return 0;
+}
+
+static int end_png(struct png_writer *writer) {
+#ifdef PNG_SETJMP_SUPPORTED
+	if (setjmp(png_jmpbuf(writer->png))) {
+		fprintf(stderr, "failed to write png\n");
+		return -1;
+	}
+#endif
+
+	png_write_end(writer->png, NULL);
+	return 0;
+}
+
+bool is_image_opaque(pixman_image_t *image) {
+	if (pixman_image_get_format(image) != PIXMAN_a8r8g8b8) {
+		return true;
+	}
+
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+	bool fully_opaque = true;
 	for (int y = 0; y < height; y++) {
-		const uint32_t *row = (const uint32_t *)(data + y * stride);
-		pack_row32(tmp_row, row, width, fully_opaque);
-		png_write_row(png, tmp_row);
+		const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+		for (int x = 0; x < width; x++) {
+			if ((row[x] >> 24) != 0xff) {
+				fully_opaque = false;
+			}
+		}
+	}
+	return fully_opaque;
+}
+
+int write_png_rect_to_sink(pixman_image_t *image, const struct grim_box *rect,
+		bool fully_opaque, struct grim_sink *sink,
+		const struct grim_png_params *params) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+
+	struct png_writer writer;
+	int ret = begin_png(&writer, sink, params, rect->width, rect->height,
+		fully_opaque);
+	for (int y = 0; ret == 0 && y < rect->height; y++) {
+		if (y % GRIM_PROBE_ROW_BATCH == 0) {
+			GRIM_PROBE(encode_rows, "png", y, rect->height,
+				(size_t)y * stride);
+		}
+		const uint32_t *row = (const uint32_t *)(data +
+			(size_t)(rect->y + y) * stride) + rect->x;
+		ret = write_png_row(&writer, row);
 	}
+	if (ret == 0) {
+		ret = end_png(&writer);
+		GRIM_PROBE(write_done, "png", sink->written);
+	}
+	finish_png(&writer);
+	return ret;
+}
 
-	png_write_end(png, NULL);
+int write_to_png_sink(pixman_image_t *image, struct grim_sink *sink,
+		const struct grim_png_params *params) {
+	struct grim_box rect = {
+		.width = pixman_image_get_width(image),
+		.height = pixman_image_get_height(image),
+	};
+	return write_png_rect_to_sink(image, &rect, is_image_opaque(image), sink,
+		params);
+}
 
-cleanup:
-	if (info) {
-		png_destroy_info_struct(png, &info);
+static int png_band_row(void *data, const uint32_t *row, int32_t y) {
+	struct png_writer *writer = data;
+	return write_png_row(writer, row);
+}
+
+int write_bands_to_png_sink(const struct grim_band_source *source,
+		struct grim_sink *sink, const struct grim_png_params *params) {
+	// Knowing whether the image is opaque would take rendering it twice
+	struct png_writer writer;
+	int ret = begin_png(&writer, sink, params, source->width,
+		source->height, false);
+	if (ret == 0) {
+		ret = grim_for_each_band_row(source, png_band_row, &writer);
 	}
-	if (png) {
-		png_destroy_write_struct(&png, NULL);
+	if (ret == 0) {
+		ret = end_png(&writer);
+		GRIM_PROBE(write_done, "png", sink->written);
 	}
-	free(tmp_row);
+	finish_png(&writer);
 	return ret;
 }
+
+static int encode_png(pixman_image_t *image, struct grim_sink *sink,
+		const void *params) {
+	return write_to_png_sink(image, sink, params);
+}
+
+static void choose_png_params(pixman_image_t *image, long deadline_ms,
+		struct grim_png_params *params) {
+	static const struct grim_png_params candidates[] = {
+		{ 0, PNG_NO_FILTERS, -1 },
+		{ 1, PNG_FILTER_UP, Z_RLE },
+		{ 1, PNG_FILTER_SUB | PNG_FILTER_UP, Z_DEFAULT_STRATEGY },
+		{ 3, PNG_ALL_FILTERS, Z_FILTERED },
+		{ 6, PNG_ALL_FILTERS, -1 },
+		{ 9, PNG_ALL_FILTERS, -1 },
+	};
+
+	struct trial_result result;
+	size_t i = choose_candidate(image, deadline_ms, encode_png, candidates,
+		sizeof(candidates[0]), sizeof(candidates) / sizeof(candidates[0]),
+		&result);
+	*params = candidates[i];
+
+	fprintf(stderr, "deadline: png level %d, filters 0x%02x, strategy %d "
+		"(expected %.0f ms, %.0f bytes)\n", params->comp_level,
+		params->filters, params->strategy, result.time_ms, result.size);
+}
+
+static int writer_encode(pixman_image_t *image, struct grim_sink *sink,
+		const struct grim_encode_options *options) {
+	struct grim_png_params params;
+	init_png_params(&params, options->level);
+	if (options->deadline_ms > 0) {
+		choose_png_params(image, options->deadline_ms, &params);
+	}
+	return write_to_png_sink(image, sink, &params);
+}
+
+static int writer_encode_bands(const struct grim_band_source *source,
+		struct grim_sink *sink, const struct grim_encode_options *options) {
+	struct grim_png_params params;
+	init_png_params(&params, options->level);
+	return write_bands_to_png_sink(source, sink, &params);
+}
+
+static pixman_image_t *writer_decode(FILE *file) {
+	png_image png = { .version = PNG_IMAGE_VERSION };
+	if (!png_image_begin_read_from_stdio(&png, file)) {
+		fprintf(stderr, "failed to read png: %s\n", png.message);
+		return NULL;
+	}
+
+	bool has_alpha = png.format & PNG_FORMAT_FLAG_ALPHA;
+	// In the byte order of native-endian a8r8g8b8
+#if GRIM_LITTLE_ENDIAN
+	png.format = PNG_FORMAT_BGRA;
+#else
+	png.format = PNG_FORMAT_ARGB;
+#endif
+	if ((size_t)png.width * png.height > INT_MAX / 4) {
+		fprintf(stderr, "png image is too large\n");
+		png_image_free(&png);
+		return NULL;
+	}
+
+	pixman_image_t *image = pixman_image_create_bits(
+		has_alpha ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
+		png.width, png.height, NULL, 0);
+	if (image == NULL) {
+		fprintf(stderr, "failed to allocate image\n");
+		png_image_free(&png);
+		return NULL;
+	}
+	uint32_t *data = pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image);
+	if (!png_image_finish_read(&png, NULL, data, stride, NULL)) {
+		fprintf(stderr, "failed to read png: %s\n", png.message);
+		pixman_image_unref(image);
+		return NULL;
+	}
+
+	// Premultiplied, like rendered images. The writer truncates when
+	// unpremultiplying, rounding up here gives back the exact pixels it
+	// was given.
+	if (has_alpha) {
+		for (uint32_t y = 0; y < png.height; y++) {
+			uint32_t *row = (uint32_t *)((uint8_t *)data + (size_t)y * stride);
+			for (uint32_t x = 0; x < png.width; x++) {
+				uint32_t p = row[x];
+				uint32_t a = p >> 24;
+				uint32_t r = (((p >> 16) & 0xff) * a + 254) / 255;
+				uint32_t g = (((p >> 8) & 0xff) * a + 254) / 255;
+				uint32_t b = ((p & 0xff) * a + 254) / 255;
+				row[x] = a << 24 | r << 16 | g << 8 | b;
+			}
+		}
+	}
+	return image;
+}
+
+static void *writer_animation_begin(struct grim_sink *sink,
+		const struct grim_encode_options *options, uint32_t n_frames) {
+	// Frames are small and many, the deadline isn't worth trials for each
+	struct grim_png_params params;
+	init_png_params(&params, options->level);
+	return apng_begin(sink, &params, n_frames);
+}
+
+static int writer_animation_add_frame(void *animation, pixman_image_t *image,
+		uint32_t delay_ms) {
+	return apng_add_frame(animation, image, delay_ms);
+}
+
+static int writer_animation_end(void *animation) {
+	return apng_end(animation);
+}
+
+const struct grim_writer grim_writer = {
+	.version = GRIM_WRITER_VERSION,
+	.name = "png",
+	.encode = writer_encode,
+	.encode_bands = writer_encode_bands,
+	.decode = writer_decode,
+	.animation_begin = writer_animation_begin,
+	.animation_add_frame = writer_animation_add_frame,
+	.animation_end = writer_animation_end,
+};
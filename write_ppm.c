@@ -9,9 +9,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "probes.h"
 #include "write_ppm.h"
 
-int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
+int write_to_ppm_sink(pixman_image_t *image, struct grim_sink *sink) {
 	// 256 bytes ought to be enough for everyone
 	char header[256];
 
@@ -21,8 +22,12 @@ int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
 	int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width, height);
 	assert(header_len <= (int)sizeof(header));
 
-	size_t len = header_len + width * height * 3;
+	size_t len = header_len + (size_t)width * height * 3;
 	unsigned char *data = malloc(len);
+	if (data == NULL) {
+		fprintf(stderr, "failed to allocate ppm data\n");
+		return -1;
+	}
 	unsigned char *buffer = data;
 
 	// We _do_not_ include the null byte
@@ -32,11 +37,18 @@ int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
 	pixman_format_code_t format = pixman_image_get_format(image);
 	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
 
-	// Both formats are native-endian 32-bit ints
-	uint32_t *pixels = pixman_image_get_data(image);
+	// Both formats are native-endian 32-bit ints. Rows may be padded, or
+	// be part of a larger image.
+	uint8_t *image_data = (uint8_t *)pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image);
 	for (int y = 0; y < height; y++) {
+		if (y % GRIM_PROBE_ROW_BATCH == 0) {
+			GRIM_PROBE(encode_rows, "ppm", y, height, (size_t)y * width * 4);
+		}
+		const uint32_t *pixels =
+			(const uint32_t *)(image_data + (size_t)y * stride);
 		for (int x = 0; x < width; x++) {
-			uint32_t p = *pixels++;
+			uint32_t p = pixels[x];
 			// RGB order
 			*buffer++ = (p >> 16) & 0xff;
 			*buffer++ = (p >>  8) & 0xff;
@@ -44,13 +56,58 @@ int write_to_ppm_stream(pixman_image_t *image, FILE *stream) {
 		}
 	}
 
-	size_t written = fwrite(data, 1, len, stream);
-	if (written < len) {
-		free(data);
-		fprintf(stderr, "Failed to write ppm; only %zu of %zu bytes written\n",
-			written, len);
-		return -1;
+	int ret = sink_write(sink, data, len);
+	GRIM_PROBE(write_done, "ppm", sink->written);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to write ppm\n");
 	}
 	free(data);
-	return 0;
+	return ret;
+}
+
+struct ppm_band_writer {
+	struct grim_sink *sink;
+	unsigned char *row;
+	int32_t width;
+};
+
+static int ppm_band_row(void *data, const uint32_t *pixels, int32_t y) {
+	struct ppm_band_writer *writer = data;
+	unsigned char *buffer = writer->row;
+	for (int32_t x = 0; x < writer->width; x++) {
+		uint32_t p = pixels[x];
+		*buffer++ = (p >> 16) & 0xff;
+		*buffer++ = (p >>  8) & 0xff;
+		*buffer++ = (p >>  0) & 0xff;
+	}
+	return sink_write(writer->sink, writer->row, (size_t)writer->width * 3);
+}
+
+int write_bands_to_ppm_sink(const struct grim_band_source *source,
+		struct grim_sink *sink) {
+	char header[256];
+	int header_len = snprintf(header, sizeof(header), "P6\n%d %d\n255\n",
+		source->width, source->height);
+	assert(header_len <= (int)sizeof(header));
+
+	struct ppm_band_writer writer = {
+		.sink = sink,
+		.row = malloc((size_t)source->width * 3),
+		.width = source->width,
+	};
+	if (writer.row == NULL) {
+		fprintf(stderr, "failed to allocate ppm row\n");
+		return -1;
+	}
+
+	int ret = sink_write(sink, header, header_len);
+	if (ret == 0) {
+		ret = grim_for_each_band_row(source, ppm_band_row, &writer);
+	}
+	GRIM_PROBE(write_done, "ppm", sink->written);
+	if (ret != 0) {
+		fprintf(stderr, "Failed to write ppm\n");
+	}
+	free(writer.row);
+	return ret;
 }
@@ -0,0 +1,181 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <webp/encode.h>
+
+#include "deadline.h"
+#include "probes.h"
+#include "write_webp.h"
+#include "writer.h"
+
+static int webp_write(const uint8_t *data, size_t data_size,
+		const WebPPicture *picture) {
+	struct grim_sink *sink = picture->custom_ptr;
+	return sink_write(sink, data, data_size) == 0;
+}
+
+#ifdef HAVE_SDT
+static int webp_progress(int percent, const WebPPicture *picture) {
+	// libwebp doesn't work row by row, report its own progress instead
+	GRIM_PROBE(encode_rows, "webp", percent * picture->height / 100,
+		picture->height, (size_t)percent * picture->height / 100 *
+		picture->width * 4);
+	return 1;
+}
+#endif
+
+static void unpremultiply_row(uint32_t *restrict row_out,
+		const uint32_t *restrict row_in, int width, bool has_alpha) {
+	for (int x = 0; x < width; x++) {
+		uint32_t p = row_in[x];
+		uint32_t a = has_alpha ? (p >> 24) & 0xff : 0xff;
+		uint32_t r = (p >> 16) & 0xff;
+		uint32_t g = (p >>  8) & 0xff;
+		uint32_t b = (p >>  0) & 0xff;
+
+		if (a != 0 && a != 255) {
+			uint32_t inv = (0xff << 16) / a;
+			uint32_t sr = r * inv;
+			r = sr > (0xff << 16) ? 0xff : (sr >> 16);
+			uint32_t sg = g * inv;
+			g = sg > (0xff << 16) ? 0xff : (sg >> 16);
+			uint32_t sb = b * inv;
+			b = sb > (0xff << 16) ? 0xff : (sb >> 16);
+		}
+
+		row_out[x] = a << 24 | r << 16 | g << 8 | b;
+	}
+}
+
+int write_to_webp_sink(pixman_image_t *image, struct grim_sink *sink,
+		int quality, int level) {
+	pixman_format_code_t format = pixman_image_get_format(image);
+	assert(format == PIXMAN_a8r8g8b8 || format == PIXMAN_x8r8g8b8);
+
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int stride = pixman_image_get_stride(image);
+	const unsigned char *data = (unsigned char *)pixman_image_get_data(image);
+
+	// A negative quality selects lossless encoding, in which case the level
+	// is the lossless effort. Otherwise, it is mapped onto the lossy method.
+	WebPConfig config;
+	if (quality < 0) {
+		if (!WebPConfigInit(&config) ||
+				!WebPConfigLosslessPreset(&config, level)) {
+			fprintf(stderr, "failed to initialize webp config\n");
+			return -1;
+		}
+	} else {
+		if (!WebPConfigPreset(&config, WEBP_PRESET_DEFAULT, quality)) {
+			fprintf(stderr, "failed to initialize webp config\n");
+			return -1;
+		}
+		config.method = level * 6 / 9;
+	}
+	config.thread_level = 1;
+
+	WebPPicture picture;
+	if (!WebPPictureInit(&picture)) {
+		fprintf(stderr, "failed to initialize webp picture\n");
+		return -1;
+	}
+	picture.use_argb = 1;
+	picture.width = width;
+	picture.height = height;
+	picture.writer = webp_write;
+	picture.custom_ptr = sink;
+#ifdef HAVE_SDT
+	picture.progress_hook = webp_progress;
+#endif
+
+	bool fully_opaque = true;
+	if (format == PIXMAN_a8r8g8b8) {
+		for (int y = 0; y < height && fully_opaque; y++) {
+			const uint32_t *row = (const uint32_t *)(data + y * stride);
+			for (int x = 0; x < width; x++) {
+				if ((row[x] >> 24) != 0xff) {
+					fully_opaque = false;
+					break;
+				}
+			}
+		}
+	}
+
+	// libwebp takes native-endian ARGB words, which is exactly how pixman
+	// stores a8r8g8b8. Opaque images can be handed over without a copy,
+	// others need their alpha set or unpremultiplied first.
+	if (format == PIXMAN_a8r8g8b8 && fully_opaque) {
+		picture.argb = (uint32_t *)data;
+		picture.argb_stride = stride / 4;
+	} else {
+		if (!WebPPictureAlloc(&picture)) {
+			fprintf(stderr, "failed to allocate webp picture\n");
+			return -1;
+		}
+		for (int y = 0; y < height; y++) {
+			const uint32_t *row = (const uint32_t *)(data + y * stride);
+			unpremultiply_row(picture.argb + y * picture.argb_stride, row,
+				width, format == PIXMAN_a8r8g8b8);
+		}
+	}
+
+	int ret = 0;
+	if (!WebPEncode(&config, &picture)) {
+		fprintf(stderr, "failed to write webp (error %d)\n",
+			picture.error_code);
+		ret = -1;
+	}
+	GRIM_PROBE(write_done, "webp", sink->written);
+
+	WebPPictureFree(&picture);
+	return ret;
+}
+
+struct webp_params {
+	int quality;
+	int level;
+};
+
+static int encode_webp(pixman_image_t *image, struct grim_sink *sink,
+		const void *params) {
+	const struct webp_params *webp_params = params;
+	return write_to_webp_sink(image, sink, webp_params->quality,
+		webp_params->level);
+}
+
+static void choose_webp_level(pixman_image_t *image, long deadline_ms,
+		int quality, int *level) {
+	const struct webp_params candidates[] = {
+		{ quality, 0 },
+		{ quality, 3 },
+		{ quality, 6 },
+		{ quality, 9 },
+	};
+
+	struct trial_result result;
+	size_t i = choose_candidate(image, deadline_ms, encode_webp, candidates,
+		sizeof(candidates[0]), sizeof(candidates) / sizeof(candidates[0]),
+		&result);
+	*level = candidates[i].level;
+
+	fprintf(stderr, "deadline: webp level %d (expected %.0f ms, %.0f bytes)\n",
+		*level, result.time_ms, result.size);
+}
+
+static int writer_encode(pixman_image_t *image, struct grim_sink *sink,
+		const struct grim_encode_options *options) {
+	int level = options->level;
+	if (options->deadline_ms > 0) {
+		choose_webp_level(image, options->deadline_ms, options->quality,
+			&level);
+	}
+	return write_to_webp_sink(image, sink, options->quality, level);
+}
+
+const struct grim_writer grim_writer = {
+	.version = GRIM_WRITER_VERSION,
+	.name = "webp",
+	.encode = writer_encode,
+};